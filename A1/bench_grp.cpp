@@ -0,0 +1,403 @@
+// Load generator and latency benchmark for the chat server.
+//
+// Opens N sessions spread over T threads (one chat::EventLoop each), logs them in with the normal
+// Username/Password frames, puts every session into one of G groups and then drives a mix of
+// /broadcast, /msg and /group msg at a fixed total rate. Every message carries its send time
+// ("#<ns>#") so the receiving session can compute delivery latency; the report gives throughput
+// and p50/p99/p999 latency.
+//
+// Usage: bench_grp [--host IP] [--port N] [--users FILE] [--sessions N] [--threads T]
+//                  [--rate MSGS_PER_SEC] [--duration SECS] [--mix B:M:G] [--groups G] [--payload BYTES]
+//        bench_grp --gen-users FILE N     (writes N synthetic user:password lines)
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <memory>
+#include <sys/resource.h>
+#include "chat_client.h"
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    std::string users_file = "users.txt";
+    int sessions = 100;
+    int threads = 4;
+    double rate = 10000;    // messages per second, all threads together
+    double duration = 10;   // seconds of measured load
+    int mix[3] = {1, 8, 1}; // weights: broadcast, private, group
+    int groups = 10;
+    size_t payload = 64;
+};
+
+BenchConfig config;
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear latency histogram: 16 linear sub-buckets per power of two, so every recorded value
+// is reported within ~6%. Fixed size, no allocation while recording, cheap to merge.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int BUCKETS = 64 << SUB_BITS;
+
+    void record(uint64_t value) {
+        ++counts_[index_of(value)];
+        ++total_;
+    }
+
+    void merge(const Histogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+    }
+
+    uint64_t total() const { return total_; }
+
+    uint64_t percentile(double p) const {
+        if (total_ == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * total_));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return upper_bound_of(i);
+        }
+        return upper_bound_of(BUCKETS - 1);
+    }
+
+private:
+    static int index_of(uint64_t v) {
+        if (v < (1u << SUB_BITS)) return static_cast<int>(v);
+        int exponent = 63 - __builtin_clzll(v);
+        int sub = static_cast<int>((v >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+        return ((exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+
+    static uint64_t upper_bound_of(int index) {
+        if (index < (1 << SUB_BITS)) return index;
+        int exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+        uint64_t sub = index & ((1 << SUB_BITS) - 1);
+        return ((uint64_t(1) << SUB_BITS | sub) + 1) << (exponent - SUB_BITS);
+    }
+
+    uint64_t counts_[BUCKETS] = {};
+    uint64_t total_ = 0;
+};
+
+struct Session {
+    int index = 0;
+    std::unique_ptr<chat::ClientSession> client;
+    int pending_replies = 0;  // Info/Error replies still expected for setup commands
+};
+
+enum Phase { Connecting, CreatingGroups, JoiningGroups, Loading, Draining, Done };
+std::atomic<int> phase{Connecting};
+std::atomic<int> sessions_ready{0};  // how many sessions finished the current setup step
+
+struct ThreadStats {
+    uint64_t sent[3] = {};
+    uint64_t delivered = 0;
+    uint64_t errors = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    Histogram latency;
+};
+
+std::vector<std::pair<std::string, std::string>> load_users(const std::string& path) {
+    std::vector<std::pair<std::string, std::string>> result;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t colon = line.find(':');
+        if (colon != std::string::npos) result.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+    }
+    return result;
+}
+
+std::string group_name(int index) { return "bench_g" + std::to_string(index % config.groups); }
+
+// Pulls "#<ns>#" out of a delivered message and records its latency.
+void record_delivery(std::string_view text, ThreadStats& stats) {
+    size_t start = text.find('#');
+    if (start == std::string_view::npos) return;
+    uint64_t sent_at = 0;
+    size_t i = start + 1;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+        sent_at = sent_at * 10 + (text[i] - '0');
+        ++i;
+    }
+    if (i >= text.size() || text[i] != '#') return;
+    ++stats.delivered;
+    uint64_t now = now_ns();
+    stats.latency.record(now > sent_at ? now - sent_at : 0);
+}
+
+// Handles every frame a session receives once it is logged in.
+void on_frame(Session& session, chat::Op op, std::string_view payload, ThreadStats& stats) {
+    switch (op) {
+    case chat::Op::Message:
+        record_delivery(payload, stats);
+        break;
+    case chat::Op::Info:
+    case chat::Op::Error:
+        if (session.pending_replies > 0) {
+            if (--session.pending_replies == 0) ++sessions_ready;
+        } else if (op == chat::Op::Error) {
+            ++stats.errors;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Builds one load message of the requested kind from a random session in this thread.
+std::string make_load_frame(int kind, const Session& from, const std::vector<std::pair<std::string, std::string>>& users,
+                            std::mt19937& rng) {
+    std::string text = "#" + std::to_string(now_ns()) + "#";
+    if (text.size() < config.payload) text.append(config.payload - text.size(), 'x');
+
+    std::string frame;
+    if (kind == 0) {
+        chat::append_frame(frame, chat::Op::Broadcast, text);
+    } else if (kind == 1) {
+        std::uniform_int_distribution<int> pick(0, config.sessions - 1);
+        const std::string& recipient = users[pick(rng) % users.size()].first;
+        chat::append_frame(frame, chat::Op::PrivateMsg, recipient, text);
+    } else {
+        chat::append_frame(frame, chat::Op::GroupMsg, group_name(from.index), text);
+    }
+    return frame;
+}
+
+void wait_for_phase(int target) {
+    while (phase.load() < target) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void run_thread(int thread_index, std::vector<Session*> mine, const std::vector<std::pair<std::string, std::string>>& users,
+                ThreadStats& stats) {
+    chat::EventLoop loop;
+    for (Session* session : mine) {
+        chat::ClientSession::Options options;
+        options.host = config.host;
+        options.port = config.port;
+        options.username = users[session->index % users.size()].first;
+        options.password = users[session->index % users.size()].second;
+        options.compression = false;  // measure the plain protocol
+        options.reconnect = false;    // a dropped session is an error, not something to hide
+
+        chat::ClientSession::Callbacks callbacks;
+        callbacks.on_login = [](std::string_view) { ++sessions_ready; };
+        callbacks.on_auth_failed = [&stats, session](std::string_view) {
+            std::cerr << "Authentication failed for " << session->client->options().username << std::endl;
+            ++stats.errors;
+        };
+        callbacks.on_frame = [&stats, session](chat::Op op, std::string_view payload) { on_frame(*session, op, payload, stats); };
+        callbacks.on_disconnect = [&stats](bool) { ++stats.errors; };
+
+        // Login is pipelined: the frames go out without waiting for the prompts.
+        session->client = std::make_unique<chat::ClientSession>(loop, std::move(options), std::move(callbacks));
+        session->client->connect();
+    }
+
+    std::mt19937 rng(thread_index * 7919 + 1);
+    int total_weight = config.mix[0] + config.mix[1] + config.mix[2];
+    std::uniform_int_distribution<int> pick_weight(0, std::max(0, total_weight - 1));
+    std::uniform_int_distribution<size_t> pick_session(0, mine.empty() ? 0 : mine.size() - 1);
+
+    double thread_rate = config.rate / config.threads;
+    uint64_t interval = thread_rate > 0 ? static_cast<uint64_t>(1e9 / thread_rate) : 0;
+    uint64_t next_send = 0;
+    int seen_phase = Connecting;
+
+    while (true) {
+        int current = phase.load();
+        if (current == Done) break;
+
+        if (current != seen_phase) {
+            seen_phase = current;
+            if (current == CreatingGroups || current == JoiningGroups) {
+                for (Session* session : mine) {
+                    bool creator = session->index < config.groups;
+                    if (current == CreatingGroups && !creator) continue;
+                    chat::Op op = current == CreatingGroups ? chat::Op::GroupCreate : chat::Op::GroupJoin;
+                    if (current == JoiningGroups && creator) continue;  // creators are members already
+                    session->pending_replies = 1;
+                    session->client->send(op, group_name(session->index));
+                }
+            } else if (current == Loading) {
+                next_send = now_ns();
+            }
+        }
+
+        int timeout = 10;
+        if (current == Loading && interval > 0) {
+            uint64_t now = now_ns();
+            // Catch up on every send that is due; the schedule is open-loop so server stalls show up as latency.
+            while (next_send <= now && !mine.empty()) {
+                Session& from = *mine[pick_session(rng)];
+                int roll = pick_weight(rng);
+                int kind = roll < config.mix[0] ? 0 : roll < config.mix[0] + config.mix[1] ? 1 : 2;
+                from.client->send_frame(make_load_frame(kind, from, users, rng));
+                ++stats.sent[kind];
+                next_send += interval;
+            }
+            timeout = static_cast<int>(std::min<uint64_t>(10, (next_send - now) / 1000000));
+        }
+
+        loop.run_once(timeout);
+    }
+
+    for (Session* session : mine) {
+        stats.bytes_in += session->client->bytes_in();
+        stats.bytes_out += session->client->bytes_out();
+        session->client.reset();
+    }
+}
+
+// Blocks until every session has bumped sessions_ready (or the timeout hits), then resets it.
+bool wait_ready(int expected, double timeout_seconds, const char* what) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout_seconds);
+    while (sessions_ready.load() < expected) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            std::cerr << "Timed out waiting for " << what << " (" << sessions_ready.load() << "/" << expected << ")" << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    sessions_ready = 0;
+    return true;
+}
+
+int generate_users(const std::string& path, int count) {
+    std::ofstream file(path);
+    if (!file) {
+        std::cerr << "Error: Could not write " << path << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) file << "bench_user_" << i << ":pw" << i << "\n";
+    return 0;
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--host") config.host = value;
+        else if (arg == "--port") config.port = std::atoi(value.c_str());
+        else if (arg == "--users") config.users_file = value;
+        else if (arg == "--sessions") config.sessions = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--threads") config.threads = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--rate") config.rate = std::atof(value.c_str());
+        else if (arg == "--duration") config.duration = std::atof(value.c_str());
+        else if (arg == "--groups") config.groups = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--payload") config.payload = std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--mix") {
+            if (std::sscanf(value.c_str(), "%d:%d:%d", &config.mix[0], &config.mix[1], &config.mix[2]) != 3) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 && std::string(argv[1]) == "--gen-users") {
+        return generate_users(argv[2], std::atoi(argv[3]));
+    }
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--host IP] [--port N] [--users FILE] [--sessions N] [--threads T]"
+                  << " [--rate MSGS_PER_SEC] [--duration SECS] [--mix B:M:G] [--groups G] [--payload BYTES]\n"
+                  << "       " << argv[0] << " --gen-users FILE N" << std::endl;
+        return 1;
+    }
+
+    auto users = load_users(config.users_file);
+    if (users.empty()) {
+        std::cerr << "Error: no users in " << config.users_file << std::endl;
+        return 1;
+    }
+    if (static_cast<size_t>(config.sessions) > users.size()) {
+        std::cerr << "Warning: " << config.sessions << " sessions but only " << users.size()
+                  << " users; users will be logged in more than once" << std::endl;
+    }
+    config.groups = std::min(config.groups, config.sessions);
+    config.threads = std::min(config.threads, config.sessions);
+
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    std::vector<Session> sessions(config.sessions);
+    for (int i = 0; i < config.sessions; ++i) sessions[i].index = i;
+
+    std::vector<ThreadStats> stats(config.threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < config.threads; ++t) {
+        std::vector<Session*> mine;
+        for (int i = t; i < config.sessions; i += config.threads) mine.push_back(&sessions[i]);
+        threads.emplace_back(run_thread, t, std::move(mine), std::cref(users), std::ref(stats[t]));
+    }
+
+    bool ok = wait_ready(config.sessions, 30, "logins");
+    if (ok) {
+        phase = CreatingGroups;
+        ok = wait_ready(config.groups, 30, "group creation");
+    }
+    if (ok) {
+        phase = JoiningGroups;
+        ok = wait_ready(config.sessions - config.groups, 30, "group joins");
+    }
+
+    uint64_t load_start = now_ns();
+    uint64_t load_end = load_start;
+    if (ok) {
+        phase = Loading;
+        std::this_thread::sleep_for(std::chrono::duration<double>(config.duration));
+        load_end = now_ns();
+        phase = Draining;
+        std::this_thread::sleep_for(std::chrono::seconds(1));  // let in-flight deliveries land
+    }
+    phase = Done;
+    for (auto& thread : threads) thread.join();
+    if (!ok) return 1;
+
+    ThreadStats total;
+    for (const auto& s : stats) {
+        for (int k = 0; k < 3; ++k) total.sent[k] += s.sent[k];
+        total.delivered += s.delivered;
+        total.errors += s.errors;
+        total.bytes_in += s.bytes_in;
+        total.bytes_out += s.bytes_out;
+        total.latency.merge(s.latency);
+    }
+
+    double seconds = (load_end - load_start) / 1e9;
+    uint64_t sent = total.sent[0] + total.sent[1] + total.sent[2];
+    std::cout << "sessions:      " << config.sessions << " over " << config.threads << " threads, "
+              << config.groups << " groups\n"
+              << "sent:          " << sent << " (broadcast " << total.sent[0] << ", msg " << total.sent[1]
+              << ", group " << total.sent[2] << ") = " << static_cast<uint64_t>(sent / seconds) << " msg/s\n"
+              << "delivered:     " << total.delivered << " = " << static_cast<uint64_t>(total.delivered / seconds) << " msg/s\n"
+              << "errors:        " << total.errors << "\n"
+              << "bytes out/in:  " << total.bytes_out << " / " << total.bytes_in << "\n"
+              << "latency (us):  p50 " << total.latency.percentile(50) / 1000.0
+              << "  p99 " << total.latency.percentile(99) / 1000.0
+              << "  p999 " << total.latency.percentile(99.9) / 1000.0 << std::endl;
+    return 0;
+}
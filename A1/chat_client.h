@@ -0,0 +1,450 @@
+// Event-driven client library for the chat server, used by client_grp.cpp and bench_grp.cpp.
+//
+// An EventLoop is one epoll instance plus a timer heap, driven by a single thread. Any number of
+// ClientSessions share a loop: each owns a non-blocking socket, an inbound ring buffer and a queue
+// of encoded frames written with writev(). Nothing blocks, so one thread can run thousands of bot
+// sessions, and other descriptors (stdin, a gateway's own sockets) can be watched on the same loop.
+//
+// Sends are pipelined: the login frames go out as soon as the connection is up, commands queued
+// before or during login follow right behind them, and no send waits for a reply. If the
+// connection drops, frames the server never fully received stay queued and the session logs in
+// again after an exponential backoff. All methods must be called from the loop's thread.
+
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "protocol.h"
+#include "compression.h"
+
+namespace chat {
+
+class EventLoop {
+public:
+    // Anything registered with the loop; events are the epoll flags that fired.
+    class Handler {
+    public:
+        virtual void handle_events(uint32_t events) = 0;
+
+    protected:
+        ~Handler() = default;
+    };
+
+    EventLoop() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    ~EventLoop() { close(epoll_fd_); }
+
+    static uint64_t now_ms() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    bool add(int fd, uint32_t events, Handler* handler) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.ptr = handler;
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    // Safe from inside a callback: events already fetched for handler are skipped.
+    void remove(int fd, Handler* handler) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        if (dispatching_) removed_.insert(handler);
+    }
+
+    // Calls on_readable while fd has data (level-triggered), e.g. for stdin.
+    void watch(int fd, std::function<void()> on_readable) {
+        auto& watch = watches_[fd];
+        watch = std::make_unique<FdWatch>(std::move(on_readable));
+        add(fd, EPOLLIN, watch.get());
+    }
+
+    void unwatch(int fd) {
+        auto it = watches_.find(fd);
+        if (it == watches_.end()) return;
+        remove(fd, it->second.get());
+        retired_.push_back(std::move(it->second));  // may be the running callback
+        watches_.erase(it);
+    }
+
+    // Runs callback once, no earlier than delay_ms from now.
+    void run_after(uint64_t delay_ms, std::function<void()> callback) {
+        timers_.push(Timer{now_ms() + delay_ms, next_timer_id_++, std::move(callback)});
+    }
+
+    // Waits up to max_wait_ms (-1 = until something happens) and dispatches what is ready.
+    void run_once(int max_wait_ms) {
+        int timeout = max_wait_ms;
+        if (!timers_.empty()) {
+            uint64_t now = now_ms();
+            int until_timer = timers_.top().deadline > now ? static_cast<int>(timers_.top().deadline - now) : 0;
+            timeout = timeout < 0 ? until_timer : std::min(timeout, until_timer);
+        }
+
+        epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+        dispatching_ = true;
+        for (int i = 0; i < n; ++i) {
+            Handler* handler = static_cast<Handler*>(events[i].data.ptr);
+            if (!removed_.count(handler)) handler->handle_events(events[i].events);
+        }
+        dispatching_ = false;
+        removed_.clear();
+        retired_.clear();
+
+        uint64_t now = now_ms();
+        while (!timers_.empty() && timers_.top().deadline <= now) {
+            std::function<void()> callback = std::move(const_cast<Timer&>(timers_.top()).callback);
+            timers_.pop();
+            callback();
+        }
+    }
+
+    // Runs until stop() is called.
+    void run() {
+        while (!stopped_) run_once(-1);
+    }
+
+    void stop() { stopped_ = true; }
+
+private:
+    static constexpr int MAX_EVENTS = 256;
+
+    struct FdWatch : Handler {
+        explicit FdWatch(std::function<void()> callback) : callback(std::move(callback)) {}
+        void handle_events(uint32_t) override { callback(); }
+        std::function<void()> callback;
+    };
+
+    struct Timer {
+        uint64_t deadline;
+        uint64_t id;  // keeps timers with equal deadlines in the order they were set
+        std::function<void()> callback;
+        bool operator>(const Timer& other) const {
+            return deadline != other.deadline ? deadline > other.deadline : id > other.id;
+        }
+    };
+
+    int epoll_fd_;
+    bool dispatching_ = false;
+    bool stopped_ = false;
+    std::unordered_set<Handler*> removed_;
+    std::unordered_map<int, std::unique_ptr<FdWatch>> watches_;
+    std::vector<std::unique_ptr<FdWatch>> retired_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t next_timer_id_ = 0;
+};
+
+// One logged-in connection to the server.
+class ClientSession : private EventLoop::Handler {
+public:
+    enum class State { Idle, Connecting, LoggingIn, Ready, Backoff, Failed, Closed };
+
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 12345;
+        std::string username;
+        std::string password;
+        bool compression = true;         // ask the server for deflate (see compression.h)
+        bool reconnect = true;           // log in again after the connection drops
+        uint64_t min_backoff_ms = 100;   // doubled after each failed attempt, up to max_backoff_ms
+        uint64_t max_backoff_ms = 5000;
+    };
+
+    struct Callbacks {
+        std::function<void(std::string_view welcome)> on_login;
+        std::function<void(std::string_view reason)> on_auth_failed;  // the session stays Failed
+        // Every other server frame, compressed ones already inflated. Prompts are not passed on.
+        std::function<void(Op op, std::string_view payload)> on_frame;
+        std::function<void(bool will_retry)> on_disconnect;
+    };
+
+    ClientSession(EventLoop& loop, Options options, Callbacks callbacks)
+        : loop_(loop), options_(std::move(options)), callbacks_(std::move(callbacks)), backoff_ms_(options_.min_backoff_ms) {}
+    ClientSession(const ClientSession&) = delete;
+    ClientSession& operator=(const ClientSession&) = delete;
+    ~ClientSession() { drop_socket(); }
+
+    State state() const { return state_; }
+    bool ready() const { return state_ == State::Ready; }
+    const Options& options() const { return options_; }
+    size_t queued_bytes() const { return queued_bytes_; }
+    uint64_t bytes_in() const { return bytes_in_; }
+    uint64_t bytes_out() const { return bytes_out_; }
+
+    // Starts connecting; the result arrives through the callbacks.
+    void connect() {
+        if (fd_ >= 0) return;
+        closing_ = false;
+        fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            connection_lost();
+            return;
+        }
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(options_.port);
+        address.sin_addr.s_addr = inet_addr(options_.host.c_str());
+        if (::connect(fd_, (sockaddr*)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+            connection_lost();
+            return;
+        }
+        state_ = State::Connecting;
+        loop_.add(fd_, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, this);
+
+        // Login goes first and is pipelined with whatever is already queued.
+        std::string login;
+        if (options_.compression) append_frame(login, Op::Capabilities, COMPRESSION_FEATURE);
+        append_frame(login, Op::Username, options_.username);
+        append_frame(login, Op::Password, options_.password);
+        queued_bytes_ += login.size();
+        out_queue_.push_front(std::move(login));
+        login_queued_ = true;
+        out_offset_ = 0;
+    }
+
+    // Queues one encoded frame. Frames queued before login completes go out right after it.
+    void send_frame(std::string frame) {
+        if (state_ == State::Failed || state_ == State::Closed) return;
+        queued_bytes_ += frame.size();
+        out_queue_.push_back(std::move(frame));
+        if (state_ == State::LoggingIn || state_ == State::Ready) flush();
+    }
+
+    void send(Op op, std::string_view text) { send_frame(make_frame(op, text)); }
+
+    void send(Op op, std::string_view field, std::string_view text) {
+        std::string frame;
+        append_frame(frame, op, field, text);
+        send_frame(std::move(frame));
+    }
+
+    // Sends a line as typed in client_grp ("/msg bob hi"). Returns false with error set if it is
+    // not a valid command.
+    bool send_command(std::string_view line, std::string& error) {
+        std::string frame;
+        if (!encode_command(line, frame, error)) return false;
+        send_frame(std::move(frame));
+        return true;
+    }
+
+    // Disconnects once everything queued has been written, without reconnecting.
+    void close_when_flushed() {
+        closing_ = true;
+        if (out_queue_.empty() || fd_ < 0) close();
+    }
+
+    // Disconnects now and drops anything still queued.
+    void close() {
+        bool was_connected = fd_ >= 0;
+        drop_socket();
+        out_queue_.clear();
+        queued_bytes_ = 0;
+        state_ = State::Closed;
+        if (was_connected && callbacks_.on_disconnect) callbacks_.on_disconnect(false);
+    }
+
+private:
+    static constexpr int MAX_IOV = 64;
+
+    void handle_events(uint32_t events) override {
+        if (state_ == State::Connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                connection_lost();
+                return;
+            }
+            state_ = State::LoggingIn;
+        }
+        if (state_ == State::Connecting) return;
+        if ((events & EPOLLOUT) && !flush()) return;
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) read_available();
+    }
+
+    // Writes as much of the queue as the socket takes. Returns false if the connection was lost.
+    bool flush() {
+        while (!out_queue_.empty()) {
+            iovec iov[MAX_IOV];
+            int count = 0;
+            size_t skip = out_offset_;
+            for (auto it = out_queue_.begin(); it != out_queue_.end() && count < MAX_IOV; ++it, ++count) {
+                iov[count].iov_base = const_cast<char*>(it->data()) + skip;
+                iov[count].iov_len = it->size() - skip;
+                skip = 0;
+            }
+            msghdr message{};
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+            ssize_t n = sendmsg(fd_, &message, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (n < 0) {
+                connection_lost();
+                return false;
+            }
+            bytes_out_ += n;
+            queued_bytes_ -= n;
+            size_t written = n;
+            while (written > 0) {
+                size_t remaining = out_queue_.front().size() - out_offset_;
+                if (written < remaining) {
+                    out_offset_ += written;
+                    break;
+                }
+                written -= remaining;
+                out_queue_.pop_front();
+                out_offset_ = 0;
+                login_queued_ = false;
+            }
+        }
+        if (closing_) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void read_available() {
+        std::weak_ptr<char> alive = alive_;
+        while (fd_ >= 0) {
+            inbound_.reserve_free(4096);
+            iovec iov[2];
+            int count = inbound_.writable_regions(iov);
+            ssize_t n = readv(fd_, iov, count);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (n <= 0) {
+                connection_lost();
+                return;
+            }
+            inbound_.commit(n);
+            bytes_in_ += n;
+
+            Frame frame;
+            FrameParser::Result result;
+            uint64_t generation = generation_;
+            while ((result = parser_.next(frame)) == FrameParser::Result::Frame) {
+                dispatch(frame);
+                // A callback may have closed, reconnected or destroyed this session.
+                if (alive.expired() || generation != generation_) return;
+            }
+            if (result == FrameParser::Result::Error) {
+                connection_lost();
+                return;
+            }
+        }
+    }
+
+    void dispatch(Frame frame) {
+        if (frame.op == Op::Compressed) {
+            if (!decompress_frame(frame.payload, inflated_)) return;
+            frame.op = static_cast<Op>(inflated_[0]);
+            frame.payload = std::string_view(inflated_).substr(1);
+        }
+        switch (frame.op) {
+        case Op::Prompt:
+        case Op::CapabilitiesAck:
+            break;
+        case Op::AuthOk:
+            state_ = State::Ready;
+            backoff_ms_ = options_.min_backoff_ms;
+            if (callbacks_.on_login) callbacks_.on_login(frame.payload);
+            break;
+        case Op::AuthFailed: {
+            std::string reason(frame.payload);
+            drop_socket();
+            state_ = State::Failed;
+            if (callbacks_.on_auth_failed) callbacks_.on_auth_failed(reason);
+            break;
+        }
+        default:
+            if (callbacks_.on_frame) callbacks_.on_frame(frame.op, frame.payload);
+            break;
+        }
+    }
+
+    void drop_socket() {
+        if (fd_ < 0) return;
+        loop_.remove(fd_, this);
+        ::close(fd_);
+        fd_ = -1;
+        ++generation_;
+        inbound_ = RingBuffer();
+        parser_.reset();
+    }
+
+    // Keeps every frame the server has not fully received, drops the old login and retries.
+    void connection_lost() {
+        drop_socket();
+        if (login_queued_) {
+            queued_bytes_ -= out_queue_.front().size() - out_offset_;
+            out_queue_.pop_front();
+            login_queued_ = false;
+        } else if (!out_queue_.empty()) {
+            queued_bytes_ += out_offset_;
+        }
+        out_offset_ = 0;
+
+        bool retry = options_.reconnect && !closing_;
+        state_ = retry ? State::Backoff : State::Closed;
+        if (retry) {
+            std::weak_ptr<char> alive = alive_;
+            loop_.run_after(backoff_ms_, [this, alive] {
+                if (!alive.expired() && state_ == State::Backoff) connect();
+            });
+            backoff_ms_ = std::min(backoff_ms_ * 2, options_.max_backoff_ms);
+        }
+        if (callbacks_.on_disconnect) callbacks_.on_disconnect(retry);
+    }
+
+    EventLoop& loop_;
+    Options options_;
+    Callbacks callbacks_;
+    State state_ = State::Idle;
+    int fd_ = -1;
+    uint64_t generation_ = 0;  // bumped per socket, so callbacks can tell the connection changed
+    std::shared_ptr<char> alive_ = std::make_shared<char>();  // expires with the session, for deferred work
+    uint64_t backoff_ms_;
+    bool closing_ = false;
+
+    RingBuffer inbound_;
+    FrameParser parser_{inbound_};
+    std::string inflated_;
+
+    std::deque<std::string> out_queue_;  // whole encoded frames
+    size_t out_offset_ = 0;              // bytes of out_queue_.front() already written
+    size_t queued_bytes_ = 0;
+    bool login_queued_ = false;          // out_queue_.front() is this connection's login
+
+    uint64_t bytes_in_ = 0;
+    uint64_t bytes_out_ = 0;
+};
+
+}  // namespace chat
+
+#endif
@@ -1,107 +1,107 @@
-// Client-side implementation in C++ for a chat server with private messages and group messaging
-
-#include <iostream>
-#include <string>
-#include <thread>
-#include <mutex>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
-#include <sstream>
-#include <cstring>
-#include <cstdlib>
-#include <unistd.h>
-#include <arpa/inet.h>
-
-
-#define BUFFER_SIZE 1024
-
-std::mutex cout_mutex;
-
-void handle_server_messages(int server_socket) {
-    char buffer[BUFFER_SIZE];
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            std::lock_guard<std::mutex> lock(cout_mutex);
-            std::cout << "Disconnected from server." << std::endl;
-            close(server_socket);
-            exit(0);
-        }
-        std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
-    }
-}
-
-int main() {
-    int client_socket;
-    sockaddr_in server_address{};
-
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        std::cerr << "Error creating socket." << std::endl;
-        return 1;
-    }
-
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
-    server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        std::cerr << "Error connecting to server." << std::endl;
-        return 1;
-    }
-
-    std::cout << "Connected to the server." << std::endl;
-
-    // Authentication
-    std::string username, password;
-    char buffer[BUFFER_SIZE];
-
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
-    // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
- 
-    std::cout << buffer;
-    std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
-    std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
-
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
-        close(client_socket);
-        return 1;
-    }
-
-    // Start thread for receiving messages from server
-    std::thread receive_thread(handle_server_messages, client_socket);
-    // We use detach because we want this thread to run in the background while the main thread continues running
-    receive_thread.detach();
-
-    // Send messages to the server
-    while (true) {
-        std::string message;
-        std::getline(std::cin, message);
-
-        if (message.empty()) continue;
-
-        send(client_socket, message.c_str(), message.size(), 0);
-
-        if (message == "/exit") {
-            close(client_socket);
-            break;
-        }
-    }
-
-    return 0;
-}
+// Client-side implementation in C++ for a chat server with private messages and group messaging
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+
+#include "chat_client.h"
+
+// Reads one line from stdin without stdio buffering, so nothing typed ahead is hidden from the
+// event loop that reads stdin later. Returns false at end of input.
+bool read_line(std::string& input, std::string& line) {
+    size_t newline;
+    while ((newline = input.find('\n')) == std::string::npos) {
+        char buffer[4096];
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        input.append(buffer, n);
+    }
+    line = input.substr(0, newline);
+    input.erase(0, newline + 1);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    // Optional port, to reach another node of a multi-process server (default 12345).
+    chat::ClientSession::Options options;
+    options.port = argc > 1 ? std::atoi(argv[1]) : 12345;
+
+    // Authentication: login is pipelined, so the credentials are read before connecting
+    std::string input;
+    std::cout << "Enter username: " << std::flush;
+    if (!read_line(input, options.username)) return 1;
+    std::cout << "Enter password: " << std::flush;
+    if (!read_line(input, options.password)) return 1;
+
+    chat::EventLoop loop;
+    int status = 0;
+    bool logged_in = false;  // at least once
+    bool online = false;
+
+    chat::ClientSession::Callbacks callbacks;
+    callbacks.on_login = [&](std::string_view welcome) {
+        if (!logged_in) std::cout << "Connected to the server.\n" << welcome << std::endl;
+        else std::cout << "Reconnected to the server." << std::endl;
+        logged_in = online = true;
+    };
+    callbacks.on_auth_failed = [&](std::string_view reason) {
+        std::cout << reason << std::endl;
+        status = 1;
+        loop.stop();
+    };
+    callbacks.on_frame = [](chat::Op, std::string_view payload) { std::cout << payload << std::endl; };
+    callbacks.on_disconnect = [&](bool will_retry) {
+        if (!will_retry) {
+            loop.stop();
+        } else if (online) {
+            std::cout << "Disconnected from server, reconnecting..." << std::endl;
+            online = false;
+        } else if (!logged_in) {
+            // Never got in: the server is not there, so do not wait for it
+            std::cerr << "Error connecting to server." << std::endl;
+            status = 1;
+            loop.stop();
+        }
+    };
+
+    chat::ClientSession session(loop, options, callbacks);
+    session.connect();
+
+    // Commands typed while the connection is down are queued and sent after the next login
+    auto send_lines = [&] {
+        size_t newline;
+        while ((newline = input.find('\n')) != std::string::npos) {
+            std::string message = input.substr(0, newline);
+            input.erase(0, newline + 1);
+            if (message.empty()) continue;
+
+            if (message == "/exit") {
+                session.close();
+                loop.stop();
+                return;
+            }
+
+            std::string error;
+            if (!session.send_command(message, error)) std::cout << error << std::endl;
+        }
+    };
+    send_lines();  // whatever was typed ahead of the password
+    loop.watch(STDIN_FILENO, [&] {
+        char buffer[4096];
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) return;
+        if (n > 0) input.append(buffer, n);
+        send_lines();
+        if (n <= 0) {
+            // End of input: stop once what was typed has reached the server
+            loop.unwatch(STDIN_FILENO);
+            session.close_when_flushed();
+        }
+    });
+
+    loop.run();
+    return status;
+}
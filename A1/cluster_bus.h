@@ -0,0 +1,333 @@
+// Inter-node message bus for running several server_grp processes as one chat service.
+//
+// Bus is the interface server_grp.cpp codes against. UnixSocketBus is the local implementation:
+// a full mesh of Unix stream sockets under one directory (node K listens on DIR/node-K.sock and
+// connects to every node with a lower id). Another transport only has to provide the same
+// ordered, per-peer delivery and link up/down notifications.
+//
+// Messages use the client wire format from protocol.h (varint length | opcode | payload) with
+// BusOp opcodes. Senders only append to a per-peer buffer; the bus thread writes whatever has
+// accumulated with one write() per peer, so cross-node traffic is batched under load without
+// adding latency when idle.
+
+#ifndef CHAT_CLUSTER_BUS_H
+#define CHAT_CLUSTER_BUS_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "protocol.h"
+
+namespace chat {
+
+enum class BusOp : uint8_t {
+    Hello = 1,        // payload: u32 node id (little-endian), first frame on every link
+    Presence = 2,     // payload: field(user) online ("1" or "0")
+    GroupCreate = 3,  // payload: field(user) group
+    GroupJoin = 4,    // payload: field(user) group
+    GroupLeave = 5,   // payload: field(user) group
+    PrivateMsg = 6,   // payload: field(from) field(to) text
+    GroupMsg = 7,     // payload: field(from) field(group) text
+    Broadcast = 8,    // payload: field(from) text
+};
+
+class Bus {
+public:
+    struct Handler {
+        std::function<void(int node)> link_up;    // peer reachable; a good time to send it our state
+        std::function<void(int node)> link_down;  // everything learned from that peer is stale
+        std::function<void(int node, BusOp op, std::string_view payload)> message;
+    };
+
+    Bus(int node_id, int node_count) : node_id_(node_id), node_count_(node_count) {}
+    virtual ~Bus() = default;
+
+    int node_id() const { return node_id_; }
+    int node_count() const { return node_count_; }
+
+    // Handler callbacks run on the bus thread, one at a time.
+    virtual bool start(Handler handler) = 0;
+
+    // Queues one message for node: the fields are varint-prefixed, then text follows. Messages to
+    // one peer arrive in order; messages for a peer whose link is down are dropped.
+    virtual void send(int node, BusOp op, std::initializer_list<std::string_view> fields, std::string_view text = {}) = 0;
+
+    void send_all(BusOp op, std::initializer_list<std::string_view> fields, std::string_view text = {}) {
+        for (int node = 0; node < node_count_; ++node) {
+            if (node != node_id_) send(node, op, fields, text);
+        }
+    }
+
+protected:
+    static void encode(std::string& out, BusOp op, std::initializer_list<std::string_view> fields, std::string_view text) {
+        size_t body = 1 + text.size();
+        for (std::string_view field : fields) body += varint_size(field.size()) + field.size();
+        append_varint(out, static_cast<uint32_t>(body));
+        out.push_back(static_cast<char>(op));
+        for (std::string_view field : fields) append_field(out, field);
+        out.append(text);
+    }
+
+    int node_id_;
+    int node_count_;
+};
+
+class UnixSocketBus : public Bus {
+public:
+    UnixSocketBus(std::string dir, int node_id, int node_count)
+        : Bus(node_id, node_count), dir_(std::move(dir)) {
+        for (int i = 0; i < node_count; ++i) links_.push_back(std::make_unique<Link>());
+    }
+
+    bool start(Handler handler) override {
+        handler_ = std::move(handler);
+        mkdir(dir_.c_str(), 0755);
+        std::string path = socket_path(node_id_);
+        unlink(path.c_str());
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+        if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 64) < 0) {
+            perror(("bus socket " + path).c_str());
+            return false;
+        }
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        watch(listen_fd_, EPOLLIN, LISTEN_KEY);
+        watch(event_fd_, EPOLLIN, EVENT_KEY);
+        std::thread(&UnixSocketBus::run, this).detach();
+        return true;
+    }
+
+    void send(int node, BusOp op, std::initializer_list<std::string_view> fields, std::string_view text = {}) override {
+        Link& link = *links_[node];
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            if (!link.up) return;
+            wake = link.out.empty();
+            encode(link.out, op, fields, text);
+        }
+        if (wake) {
+            uint64_t one = 1;
+            ssize_t ignored = write(event_fd_, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+private:
+    static constexpr uint32_t LISTEN_KEY = 0xffffffff;
+    static constexpr uint32_t EVENT_KEY = 0xfffffffe;
+    static constexpr size_t HELLO_SIZE = 6;  // varint(5) | Hello | u32 id
+    static constexpr uint32_t MAX_BUS_FRAME = 2 * MAX_FRAME_SIZE;  // a relayed chat frame plus names
+
+    struct Inbound {
+        RingBuffer buffer{16384};
+        FrameParser parser{buffer, MAX_BUS_FRAME};
+    };
+
+    struct Link {
+        std::mutex mutex;
+        bool up = false;         // guarded by mutex; senders drop messages while down
+        std::string out;         // guarded by mutex: encoded messages not yet taken by the bus thread
+
+        // Bus thread only.
+        int fd = -1;
+        std::string writing;     // batch being written
+        size_t written = 0;
+        std::unique_ptr<Inbound> in;
+    };
+
+    std::string socket_path(int node) const { return dir_ + "/node-" + std::to_string(node) + ".sock"; }
+
+    void watch(int fd, uint32_t events, uint32_t key) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u32 = key;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    std::string hello() const {
+        std::string frame;
+        append_varint(frame, 5);
+        frame.push_back(static_cast<char>(BusOp::Hello));
+        for (int i = 0; i < 4; ++i) frame.push_back(static_cast<char>(static_cast<uint32_t>(node_id_) >> (8 * i)));
+        return frame;
+    }
+
+    // Installs fd as the link to node and reports it; replaces a stale link from a restarted peer.
+    void link_up(int node, int fd) {
+        Link& link = *links_[node];
+        if (link.fd >= 0) link_down(node);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        link.fd = fd;
+        link.writing.clear();
+        link.written = 0;
+        link.in = std::make_unique<Inbound>();
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            link.up = true;
+            link.out.clear();
+        }
+        watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, static_cast<uint32_t>(node));
+        handler_.link_up(node);
+    }
+
+    void link_down(int node) {
+        Link& link = *links_[node];
+        if (link.fd < 0) return;
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            link.up = false;
+            link.out.clear();
+        }
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, link.fd, nullptr);
+        close(link.fd);
+        link.fd = -1;
+        handler_.link_down(node);
+    }
+
+    // Lower ids accept, higher ids connect, so every pair ends up with exactly one link.
+    void connect_lower_nodes() {
+        for (int node = 0; node < node_id_; ++node) {
+            if (links_[node]->fd >= 0) continue;
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            std::snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path(node).c_str());
+            std::string greeting = hello();
+            if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+                write(fd, greeting.data(), greeting.size()) == static_cast<ssize_t>(greeting.size())) {
+                link_up(node, fd);
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    void accept_peers() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) return;
+            // The peer writes its hello right after connecting, so this wait is short.
+            timeval timeout{1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            unsigned char frame[HELLO_SIZE];
+            uint32_t node = 0;
+            if (recv(fd, frame, sizeof(frame), MSG_WAITALL) == static_cast<ssize_t>(sizeof(frame)) &&
+                frame[0] == 5 && frame[1] == static_cast<unsigned char>(BusOp::Hello)) {
+                for (int i = 0; i < 4; ++i) node |= static_cast<uint32_t>(frame[2 + i]) << (8 * i);
+            } else {
+                node = UINT32_MAX;
+            }
+            if (node <= static_cast<uint32_t>(node_id_) || node >= static_cast<uint32_t>(node_count_)) {
+                close(fd);
+                continue;
+            }
+            link_up(static_cast<int>(node), fd);
+        }
+    }
+
+    // Writes everything queued for node. Returns false if the link broke.
+    bool flush(int node) {
+        Link& link = *links_[node];
+        while (link.fd >= 0) {
+            if (link.written == link.writing.size()) {
+                link.writing.clear();
+                link.written = 0;
+                std::lock_guard<std::mutex> lock(link.mutex);
+                if (link.out.empty()) return true;
+                link.writing.swap(link.out);
+            }
+            ssize_t n = write(link.fd, link.writing.data() + link.written, link.writing.size() - link.written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;  // EPOLLOUT resumes
+            if (n <= 0) return false;
+            link.written += n;
+        }
+        return true;
+    }
+
+    // Returns false if the link broke.
+    bool read_link(int node) {
+        Link& link = *links_[node];
+        while (true) {
+            link.in->buffer.reserve_free(1);
+            iovec iov[2];
+            int count = link.in->buffer.writable_regions(iov);
+            ssize_t n = readv(link.fd, iov, count);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (n <= 0) return false;
+            link.in->buffer.commit(n);
+
+            Frame frame;
+            FrameParser::Result result;
+            while ((result = link.in->parser.next(frame)) == FrameParser::Result::Frame) {
+                handler_.message(node, static_cast<BusOp>(frame.op), frame.payload);
+            }
+            if (result == FrameParser::Result::Error) return false;
+        }
+    }
+
+    void run() {
+        epoll_event events[64];
+        while (true) {
+            connect_lower_nodes();
+            bool missing = false;
+            for (int node = 0; node < node_id_; ++node) missing |= links_[node]->fd < 0;
+            int n = epoll_wait(epoll_fd_, events, 64, missing ? 500 : -1);
+            for (int i = 0; i < n; ++i) {
+                uint32_t key = events[i].data.u32;
+                if (key == LISTEN_KEY) {
+                    accept_peers();
+                } else if (key == EVENT_KEY) {
+                    uint64_t counter;
+                    ssize_t ignored = read(event_fd_, &counter, sizeof(counter));
+                    (void)ignored;
+                    for (int node = 0; node < node_count_; ++node) {
+                        if (links_[node]->fd >= 0 && !flush(node)) link_down(node);
+                    }
+                } else {
+                    int node = static_cast<int>(key);
+                    if (links_[node]->fd < 0) continue;
+                    bool ok = true;
+                    if (events[i].events & EPOLLOUT) ok = flush(node);
+                    if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) ok = read_link(node);
+                    // Replies queued by the handlers above go out in the same pass.
+                    if (ok) ok = flush(node);
+                    if (!ok) link_down(node);
+                }
+            }
+        }
+    }
+
+    std::string dir_;
+    std::vector<std::unique_ptr<Link>> links_;
+    Handler handler_;
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int event_fd_ = -1;
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,78 @@
+// Optional frame compression shared by server_grp.cpp and client_grp.cpp.
+//
+// A client that sends Op::Capabilities with "deflate" may from then on receive Op::Compressed
+// frames, whose payload is the raw-deflated body (opcode byte + payload) of an ordinary frame.
+// Every frame is compressed on its own, so the server can compress a fan-out frame once and
+// share the result between all recipients. To make that pay for short chat lines both sides
+// prime zlib with the same preset dictionary of strings that recur in server output.
+
+#ifndef CHAT_COMPRESSION_H
+#define CHAT_COMPRESSION_H
+
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#include "protocol.h"
+
+namespace chat {
+
+inline constexpr std::string_view COMPRESSION_FEATURE = "deflate";
+
+// Most useful strings last: deflate finds matches at short distances more cheaply.
+inline constexpr std::string_view COMPRESSION_DICTIONARY =
+    "Group not found. You are not a member of group already exists. joined left created successfully. "
+    "Rate limit exceeded; messages are being dropped. is offline; the message will be delivered when they log in. "
+    "the and you that have for with this what are was but not your can just will about there "
+    "hello thanks please would could should think know from all one out when they their time "
+    "(history) (missed) [Group  from ] ";
+
+// Compresses body (opcode + payload) into a complete Op::Compressed frame. Returns an empty
+// string if the result would not be smaller than the plain frame of plain_size bytes.
+inline std::string compress_frame(std::string_view body, size_t plain_size) {
+    thread_local struct Deflater {
+        z_stream stream{};
+        bool ready = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        ~Deflater() { deflateEnd(&stream); }
+    } deflater;
+    if (!deflater.ready) return {};
+
+    z_stream& stream = deflater.stream;
+    deflateReset(&stream);
+    deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(COMPRESSION_DICTIONARY.data()),
+                         static_cast<uInt>(COMPRESSION_DICTIONARY.size()));
+    std::string packed(deflateBound(&stream, body.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data()));
+    stream.avail_in = static_cast<uInt>(body.size());
+    stream.next_out = reinterpret_cast<Bytef*>(packed.data());
+    stream.avail_out = static_cast<uInt>(packed.size());
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) return {};
+    packed.resize(stream.total_out);
+
+    std::string frame;
+    frame.reserve(packed.size() + 1 + MAX_VARINT_BYTES);
+    append_frame(frame, Op::Compressed, packed);
+    if (frame.size() >= plain_size) return {};
+    return frame;
+}
+
+// Inflates an Op::Compressed payload into out (opcode + payload). Returns false if it is corrupt
+// or would exceed MAX_FRAME_SIZE.
+inline bool decompress_frame(std::string_view packed, std::string& out) {
+    z_stream stream{};
+    if (inflateInit2(&stream, -15) != Z_OK) return false;
+    inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(COMPRESSION_DICTIONARY.data()),
+                         static_cast<uInt>(COMPRESSION_DICTIONARY.size()));
+    out.resize(MAX_FRAME_SIZE);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(packed.data()));
+    stream.avail_in = static_cast<uInt>(packed.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    int result = inflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    inflateEnd(&stream);
+    return result == Z_STREAM_END && !out.empty();
+}
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,229 @@
+// Salted credential index for server_grp.cpp.
+//
+// The index is one flat, read-only image: a header, an open-addressing hash table of fixed-size
+// slots (load factor <= 1/2, linear probing) and the usernames packed after it. The server either
+// mmap()s a prebuilt index file, which costs nothing per entry at startup however many users it
+// holds, or builds the same image in memory from a plaintext users.txt.
+//
+// Passwords are stored as PBKDF2-HMAC-SHA256 over a random 16-byte salt. The iteration count is
+// recorded in the header. Indexes built from plaintext at startup use a single iteration, since
+// the plaintext is already on disk next to them and a slow KDF would protect nothing.
+
+#ifndef CHAT_CREDENTIALS_H
+#define CHAT_CREDENTIALS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+namespace chat {
+
+class CredentialIndex {
+public:
+    static constexpr char MAGIC[8] = {'C', 'S', '4', '2', '5', 'C', 'R', 'D'};
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t SALT_SIZE = 16;
+    static constexpr size_t HASH_SIZE = 32;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t iterations;
+        uint64_t slot_count;    // power of two
+        uint64_t entry_count;
+    };
+
+    struct Slot {
+        uint64_t name_hash;     // 0 marks an empty slot
+        uint32_t name_offset;   // into the name area that follows the slots
+        uint16_t name_size;
+        uint16_t reserved;
+        uint8_t salt[SALT_SIZE];
+        uint8_t hash[HASH_SIZE];
+    };
+    static_assert(sizeof(Header) == 32 && sizeof(Slot) == 64, "index layout is part of the file format");
+
+    CredentialIndex() = default;
+    CredentialIndex(const CredentialIndex&) = delete;
+    CredentialIndex& operator=(const CredentialIndex&) = delete;
+
+    ~CredentialIndex() {
+        if (mapped_) munmap(const_cast<char*>(base_), size_);
+    }
+
+    // True if the file at path starts with the index magic (as opposed to plaintext user:password).
+    static bool is_index_file(const std::string& path) {
+        char magic[sizeof(MAGIC)];
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        bool matches = read(fd, magic, sizeof(magic)) == sizeof(magic) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+        close(fd);
+        return matches;
+    }
+
+    // Builds an index image from (username, password) pairs, hashing on every core.
+    // Duplicate usernames keep the last password, like the old users map did.
+    static std::vector<char> build(const std::vector<std::pair<std::string, std::string>>& entries, uint32_t iterations) {
+        uint64_t slot_count = 16;
+        while (slot_count < entries.size() * 2) slot_count <<= 1;
+        size_t names_size = 0;
+        for (const auto& entry : entries) names_size += entry.first.size();
+
+        std::vector<char> image(sizeof(Header) + slot_count * sizeof(Slot) + names_size);
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.iterations = iterations;
+        header.slot_count = slot_count;
+        Slot* slots = reinterpret_cast<Slot*>(image.data() + sizeof(Header));
+        char* names = image.data() + sizeof(Header) + slot_count * sizeof(Slot);
+
+        // Place every entry first (single-threaded, cheap), then hash the slots in parallel.
+        std::vector<std::pair<uint64_t, const std::string*>> work;  // slot index, password
+        std::vector<uint32_t> work_of_slot(slot_count);
+        work.reserve(entries.size());
+        size_t name_offset = 0;
+        for (const auto& [name, password] : entries) {
+            uint64_t h = name_hash(name);
+            uint64_t i = h & (slot_count - 1);
+            while (slots[i].name_hash != 0 &&
+                   !(slots[i].name_hash == h && std::string_view(names + slots[i].name_offset, slots[i].name_size) == name)) {
+                i = (i + 1) & (slot_count - 1);
+            }
+            Slot& slot = slots[i];
+            if (slot.name_hash == 0) {
+                slot.name_hash = h;
+                slot.name_offset = static_cast<uint32_t>(name_offset);
+                slot.name_size = static_cast<uint16_t>(name.size());
+                std::memcpy(names + name_offset, name.data(), name.size());
+                name_offset += name.size();
+                ++header.entry_count;
+                work_of_slot[i] = static_cast<uint32_t>(work.size());
+                work.push_back({i, &password});
+            } else {
+                work[work_of_slot[i]].second = &password;
+            }
+        }
+        std::memcpy(image.data(), &header, sizeof(header));
+        image.resize(sizeof(Header) + slot_count * sizeof(Slot) + name_offset);
+        slots = reinterpret_cast<Slot*>(image.data() + sizeof(Header));
+
+        unsigned thread_count = std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), work.size() / 64 + 1));
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < thread_count; ++t) {
+            threads.emplace_back([&, t] {
+                for (size_t i = t; i < work.size(); i += thread_count) {
+                    Slot& slot = slots[work[i].first];
+                    RAND_bytes(slot.salt, SALT_SIZE);
+                    derive(*work[i].second, slot.salt, iterations, slot.hash);
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        return image;
+    }
+
+    // Maps a prebuilt index file read-only. Returns false if it is missing or malformed.
+    bool open_file(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            close(fd);
+            return false;
+        }
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        mapped_ = true;
+        base_ = static_cast<const char*>(map);
+        size_ = st.st_size;
+        return validate();
+    }
+
+    // Adopts an image produced by build().
+    bool open_memory(std::vector<char> image) {
+        owned_ = std::move(image);
+        base_ = owned_.data();
+        size_ = owned_.size();
+        return validate();
+    }
+
+    size_t size() const { return header().entry_count; }
+    uint32_t iterations() const { return header().iterations; }
+
+    bool contains(std::string_view name) const { return find(name) != nullptr; }
+
+    // Runs the KDF and compares in constant time. Unknown users pay the same KDF cost, so the
+    // reply time does not reveal which usernames exist. Safe to call from any thread.
+    bool verify(std::string_view name, std::string_view password) const {
+        static const Slot dummy{};
+        const Slot* slot = find(name);
+        uint8_t derived[HASH_SIZE];
+        derive(password, (slot ? slot : &dummy)->salt, iterations(), derived);
+        return slot && CRYPTO_memcmp(derived, slot->hash, HASH_SIZE) == 0;
+    }
+
+private:
+    // FNV-1a, forced non-zero so 0 can mark empty slots.
+    static uint64_t name_hash(std::string_view name) {
+        uint64_t h = 1469598103934665603ULL;
+        for (char c : name) {
+            h ^= static_cast<uint8_t>(c);
+            h *= 1099511628211ULL;
+        }
+        return h | 1;
+    }
+
+    static void derive(std::string_view password, const uint8_t* salt, uint32_t iterations, uint8_t* out) {
+        PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.size()), salt, SALT_SIZE,
+                          static_cast<int>(iterations), EVP_sha256(), HASH_SIZE, out);
+    }
+
+    const Header& header() const { return *reinterpret_cast<const Header*>(base_); }
+    const Slot* slots() const { return reinterpret_cast<const Slot*>(base_ + sizeof(Header)); }
+    const char* names() const { return base_ + sizeof(Header) + header().slot_count * sizeof(Slot); }
+
+    bool validate() const {
+        const Header& h = header();
+        return std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 && h.version == VERSION && h.iterations > 0 &&
+               h.slot_count > 0 && (h.slot_count & (h.slot_count - 1)) == 0 &&
+               sizeof(Header) + h.slot_count * sizeof(Slot) <= size_;
+    }
+
+    const Slot* find(std::string_view name) const {
+        uint64_t mask = header().slot_count - 1;
+        uint64_t h = name_hash(name);
+        size_t names_size = size_ - (names() - base_);
+        for (uint64_t probe = 0, i = h & mask; probe <= mask; ++probe, i = (i + 1) & mask) {
+            const Slot& slot = slots()[i];
+            if (slot.name_hash == 0) return nullptr;
+            if (slot.name_hash == h && slot.name_offset + slot.name_size <= names_size &&
+                std::string_view(names() + slot.name_offset, slot.name_size) == name) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    const char* base_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<char> owned_;
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,151 @@
+// Session hand-off channel between an old and a new server_grp process.
+//
+// A restarting server connects to the running one over a Unix socket and receives its listening
+// sockets, its client sockets and the state that goes with them, so clients stay connected across
+// a deploy. The channel carries records framed like the chat protocol (protocol.h): a varint
+// length, a one-byte type and a payload. Records that come with a descriptor have the top bit of
+// the type set; the descriptors travel as SCM_RIGHTS in batches, and the receiver hands them out
+// in record order, so a batch boundary never has to line up with a record boundary.
+
+#ifndef CHAT_HANDOFF_H
+#define CHAT_HANDOFF_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "protocol.h"
+
+namespace chat {
+
+enum class HandoffOp : uint8_t {
+    Listener = 1,  // fd: a listening socket
+    Group = 2,     // payload: group name
+    Member = 3,    // payload: field(user) group
+    Client = 4,    // fd: the connection; payload: see hand_off_sessions() in server_grp.cpp
+    Done = 5,
+};
+
+class HandoffChannel {
+public:
+    // Sent records can be as large as a client's whole outbound queue.
+    static constexpr uint32_t MAX_RECORD = 64 << 20;
+    static constexpr size_t MAX_FDS = 250;  // per sendmsg; the kernel limit is 253
+
+    explicit HandoffChannel(int fd) : fd_(fd) {}
+    HandoffChannel(const HandoffChannel&) = delete;
+    HandoffChannel& operator=(const HandoffChannel&) = delete;
+    ~HandoffChannel() {
+        for (int fd : received_fds_) close(fd);
+        close(fd_);
+    }
+
+    // Sender side. Records are batched; flush() pushes out whatever is queued.
+    bool add(HandoffOp op, std::string_view payload, int fd = -1) {
+        uint8_t type = static_cast<uint8_t>(op) | (fd >= 0 ? FD_FLAG : 0);
+        append_frame(out_, static_cast<Op>(type), payload);
+        if (fd >= 0) out_fds_.push_back(fd);
+        if (out_fds_.size() >= MAX_FDS || out_.size() >= (1 << 20)) return flush();
+        return true;
+    }
+
+    bool flush() {
+        size_t sent = 0;
+        while (sent < out_.size()) {
+            iovec iov{out_.data() + sent, out_.size() - sent};
+            msghdr message{};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            // The descriptors ride on the first byte of the batch; a partial send still delivers them.
+            std::vector<char> control;
+            if (sent == 0 && !out_fds_.empty()) {
+                control.assign(CMSG_SPACE(out_fds_.size() * sizeof(int)), 0);
+                message.msg_control = control.data();
+                message.msg_controllen = control.size();
+                cmsghdr* header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(out_fds_.size() * sizeof(int));
+                std::memcpy(CMSG_DATA(header), out_fds_.data(), out_fds_.size() * sizeof(int));
+            }
+            ssize_t n = sendmsg(fd_, &message, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += n;
+        }
+        out_.clear();
+        out_fds_.clear();
+        return true;
+    }
+
+    // Receiver side. Blocks until the next record has arrived. fd is -1 for records without one;
+    // otherwise the caller owns it. Returns false on EOF or a malformed stream.
+    bool next(HandoffOp& op, std::string_view& payload, int& fd) {
+        while (true) {
+            Frame frame;
+            FrameParser::Result result = parser_.next(frame);
+            if (result == FrameParser::Result::Error) return false;
+            if (result == FrameParser::Result::Frame) {
+                uint8_t type = static_cast<uint8_t>(frame.op);
+                op = static_cast<HandoffOp>(type & ~FD_FLAG);
+                payload = frame.payload;
+                fd = -1;
+                if (type & FD_FLAG) {
+                    if (received_fds_.empty()) return false;
+                    fd = received_fds_.front();
+                    received_fds_.pop_front();
+                }
+                return true;
+            }
+            if (!receive()) return false;
+        }
+    }
+
+private:
+    static constexpr uint8_t FD_FLAG = 0x80;
+
+    bool receive() {
+        inbound_.reserve_free(64 * 1024);
+        iovec iov[2];
+        int count = inbound_.writable_regions(iov);
+        std::vector<char> control(CMSG_SPACE(253 * sizeof(int)));
+        msghdr message{};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        ssize_t n;
+        do {
+            n = recvmsg(fd_, &message, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return false;
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+            size_t fds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < fds; ++i) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                received_fds_.push_back(fd);
+            }
+        }
+        inbound_.commit(n);
+        return !(message.msg_flags & MSG_CTRUNC);
+    }
+
+    int fd_;
+    std::string out_;
+    std::vector<int> out_fds_;
+    RingBuffer inbound_{64 * 1024};
+    FrameParser parser_{inbound_, MAX_RECORD};
+    std::deque<int> received_fds_;
+};
+
+}  // namespace chat
+
+#endif
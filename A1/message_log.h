@@ -0,0 +1,401 @@
+// Durable, segment-based append-only message log for server_grp.cpp.
+//
+// Records are appended to an in-memory batch by whichever thread produces them (one memcpy under
+// a short mutex, no syscall). A single writer thread swaps the batch out, writes it to the current
+// segment with pwrite() and commits it with one fdatasync(), so every message that arrived while
+// the previous batch was syncing shares the next fsync (group commit). Segments are preallocated
+// files that are mmap()ed read-only, and all reads (offline replay, group history) go through the
+// mapping.
+//
+// Segment files are <dir>/segment-NNNNNN.log. Each record is
+//
+//     u32 body length | u8 type | u64 seq | u64 unix time ms | field a | field b | field c
+//
+// with integers little-endian and fields as varint-prefixed strings (see protocol.h). A zero
+// length marks the unwritten tail of a segment.
+
+#ifndef CHAT_MESSAGE_LOG_H
+#define CHAT_MESSAGE_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "protocol.h"
+
+namespace chat {
+
+enum class RecordType : uint8_t {
+    Private = 1,      // a = from, b = to, c = text (only stored while the recipient is offline)
+    Group = 2,        // a = from, b = group, c = text
+    GroupCreate = 3,  // a = user, b = group
+    GroupJoin = 4,    // a = user, b = group
+    GroupLeave = 5,   // a = user, b = group
+    Logout = 6,       // a = user
+    Delivered = 7,    // a = user, b = seq: stored private messages for a below seq were replayed
+    Login = 8,        // a = user
+};
+
+struct LogRecord {
+    RecordType type;
+    uint64_t seq;
+    uint64_t time_ms;
+    std::string_view a, b, c;
+};
+
+class MessageLog {
+public:
+    static constexpr size_t SEGMENT_SIZE = 64 << 20;
+    static constexpr size_t RECORD_HEADER = 4 + 1 + 8 + 8;
+
+    using Visitor = std::function<void(const LogRecord&)>;
+
+    explicit MessageLog(size_t history_per_group = 1000) : history_per_group_(history_per_group) {}
+
+    ~MessageLog() {
+        stop();
+        for (Segment& segment : segments_) {
+            munmap(segment.map, SEGMENT_SIZE);
+            close(segment.fd);
+        }
+    }
+
+    // Opens (creating if needed) the log directory and replays every stored record, oldest
+    // first, through restore. Must be called before start(). Returns false on I/O errors.
+    bool open(const std::string& dir, const Visitor& restore) {
+        dir_ = dir;
+        mkdir(dir.c_str(), 0755);
+
+        std::vector<uint32_t> ids;
+        if (DIR* handle = opendir(dir.c_str())) {
+            while (dirent* entry = readdir(handle)) {
+                unsigned id;
+                if (std::sscanf(entry->d_name, "segment-%u.log", &id) == 1) ids.push_back(id);
+            }
+            closedir(handle);
+        } else {
+            perror(("opendir " + dir).c_str());
+            return false;
+        }
+        std::sort(ids.begin(), ids.end());
+
+        for (uint32_t id : ids) {
+            if (!map_segment(id, false)) return false;
+            Segment& segment = segments_.back();
+            size_t offset = 0;
+            LogRecord record;
+            size_t size;
+            while ((size = parse(segment.map, offset, record)) > 0) {
+                index(record, {static_cast<uint32_t>(segments_.size() - 1), static_cast<uint32_t>(offset), record.seq});
+                restore(record);
+                next_seq_ = record.seq + 1;
+                offset += size;
+            }
+            segment.used = offset;
+        }
+        if (segments_.empty() && !map_segment(1, true)) return false;
+        return true;
+    }
+
+    void start() { writer_ = std::thread(&MessageLog::run_writer, this); }
+
+    // Writes out everything appended so far and stops the writer. Later appends are accepted but
+    // never reach the disk; this is for handing the directory over to another process.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        if (writer_.joinable()) writer_.join();
+    }
+
+    // Sequence number the next appended record will get.
+    uint64_t next_seq() const { return next_seq_.load(); }
+
+    // Queues a record for the writer thread and returns its sequence number. No syscalls.
+    uint64_t append(RecordType type, std::string_view a, std::string_view b = {}, std::string_view c = {}) {
+        uint64_t time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        size_t body = 1 + 8 + 8 + varint_size(a.size()) + a.size() + varint_size(b.size()) + b.size()
+                    + varint_size(c.size()) + c.size();
+
+        uint64_t seq;
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            seq = next_seq_++;
+            wake = pending_.empty();
+            put_u32(pending_, static_cast<uint32_t>(body));
+            pending_.push_back(static_cast<char>(type));
+            put_u64(pending_, seq);
+            put_u64(pending_, time_ms);
+            append_field(pending_, a);
+            append_field(pending_, b);
+            append_field(pending_, c);
+        }
+        if (wake) wake_.notify_one();
+        return seq;
+    }
+
+    // Delivers, oldest first, the private messages stored for user while they were offline (seq <
+    // until), and for each (group, limit) in groups the group's messages logged after the user was
+    // last seen and with seq < limit. Last seen is the newest record the user made before their
+    // latest Login: normally their Logout, or, when a session ended without one (a crash, a hand-off
+    // without a drain), the last message or group change they made. Runs on the writer thread once
+    // everything appended so far is on disk.
+    void request_missed(std::string user, std::vector<std::pair<std::string, uint64_t>> groups, uint64_t until,
+                        Visitor deliver) {
+        enqueue_request([this, user = std::move(user), groups = std::move(groups), until, deliver = std::move(deliver)] {
+            std::vector<Position> positions;
+            auto pending = pending_private_.find(user);
+            if (pending != pending_private_.end()) {
+                auto& list = pending->second;
+                auto split = std::partition(list.begin(), list.end(), [&](const Position& p) { return p.seq < until; });
+                positions.assign(list.begin(), split);
+                list.erase(list.begin(), split);
+                if (!positions.empty()) append(RecordType::Delivered, user, std::to_string(until));
+            }
+            auto seen = seen_before_login_.find(user);
+            if (seen != seen_before_login_.end()) {
+                for (const auto& [group, limit] : groups) {
+                    auto history = group_history_.find(group);
+                    if (history == group_history_.end()) continue;
+                    for (const Position& p : history->second) {
+                        if (p.seq > seen->second && p.seq < limit) positions.push_back(p);
+                    }
+                }
+            }
+            std::sort(positions.begin(), positions.end(), [](const Position& x, const Position& y) { return x.seq < y.seq; });
+            for (const Position& p : positions) deliver(read(p));
+        });
+    }
+
+    // Delivers up to count of the most recent messages of group, oldest first, then calls done.
+    void request_history(std::string group, size_t count, Visitor deliver, std::function<void(size_t)> done) {
+        enqueue_request([this, group = std::move(group), count, deliver = std::move(deliver), done = std::move(done)] {
+            size_t delivered = 0;
+            auto history = group_history_.find(group);
+            if (history != group_history_.end()) {
+                const auto& list = history->second;
+                size_t first = list.size() > count ? list.size() - count : 0;
+                for (size_t i = first; i < list.size(); ++i, ++delivered) deliver(read(list[i]));
+            }
+            done(delivered);
+        });
+    }
+
+private:
+    struct Segment {
+        uint32_t id;
+        int fd;
+        char* map;
+        size_t used;
+    };
+
+    struct Position {
+        uint32_t segment;  // index into segments_
+        uint32_t offset;
+        uint64_t seq;
+    };
+
+    static void put_u32(std::string& out, uint32_t v) {
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+
+    static void put_u64(std::string& out, uint64_t v) {
+        for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+
+    static uint64_t get_le(const char* p, int bytes) {
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+        return v;
+    }
+
+    // Parses the record at offset. Returns its total size, or 0 at the end of the written data.
+    static size_t parse(const char* base, size_t offset, LogRecord& record) {
+        if (offset + RECORD_HEADER > SEGMENT_SIZE) return 0;
+        uint32_t body = static_cast<uint32_t>(get_le(base + offset, 4));
+        if (body < RECORD_HEADER - 4 || offset + 4 + body > SEGMENT_SIZE) return 0;
+        const char* p = base + offset + 4;
+        record.type = static_cast<RecordType>(p[0]);
+        record.seq = get_le(p + 1, 8);
+        record.time_ms = get_le(p + 9, 8);
+        std::string_view fields(p + 17, body - 17);
+        if (!read_field(fields, record.a) || !read_field(fields, record.b) || !read_field(fields, record.c)) return 0;
+        return 4 + body;
+    }
+
+    LogRecord read(const Position& p) const {
+        LogRecord record{};
+        parse(segments_[p.segment].map, p.offset, record);
+        return record;
+    }
+
+    bool map_segment(uint32_t id, bool create) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/segment-%06u.log", id);
+        std::string path = dir_ + name;
+        int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+        if (fd < 0 || ftruncate(fd, SEGMENT_SIZE) < 0) {
+            perror(("open " + path).c_str());
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        void* map = mmap(nullptr, SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror(("mmap " + path).c_str());
+            close(fd);
+            return false;
+        }
+        segments_.push_back({id, fd, static_cast<char*>(map), 0});
+        return true;
+    }
+
+    // Keeps the in-memory indexes (writer thread only, or open() before the writer starts).
+    void index(const LogRecord& record, const Position& position) {
+        switch (record.type) {
+        case RecordType::Private:
+            pending_private_[std::string(record.b)].push_back(position);
+            break;
+        case RecordType::Group: {
+            auto& history = group_history_[std::string(record.b)];
+            history.push_back(position);
+            if (history.size() > history_per_group_) history.pop_front();
+            break;
+        }
+        case RecordType::Delivered: {
+            auto pending = pending_private_.find(std::string(record.a));
+            if (pending == pending_private_.end()) break;
+            uint64_t until = std::strtoull(std::string(record.b).c_str(), nullptr, 10);
+            auto& list = pending->second;
+            list.erase(std::remove_if(list.begin(), list.end(), [&](const Position& p) { return p.seq < until; }), list.end());
+            break;
+        }
+        case RecordType::Login: {
+            std::string user(record.a);
+            auto seen = last_seen_.find(user);
+            if (seen != last_seen_.end()) seen_before_login_[user] = seen->second;
+            else seen_before_login_.erase(user);
+            break;
+        }
+        default:
+            break;
+        }
+        // Every record names the user it came from in a, and they were online when it was made.
+        last_seen_[std::string(record.a)] = record.seq;
+    }
+
+    void enqueue_request(std::function<void()> request) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_.push_back(std::move(request));
+        }
+        wake_.notify_one();
+    }
+
+    // Writes batch to the current segment, rolling to a new one at record boundaries.
+    bool write_batch(const std::string& batch) {
+        size_t offset = 0;
+        while (offset < batch.size()) {
+            Segment* segment = &segments_.back();
+            size_t run = 0;
+            while (offset + run < batch.size()) {
+                size_t size = 4 + get_le(batch.data() + offset + run, 4);
+                if (segment->used + run + size > SEGMENT_SIZE) break;
+                run += size;
+            }
+            if (run == 0) {
+                if (segment->used == 0) {
+                    std::cerr << "Message log: record larger than a segment dropped" << std::endl;
+                    offset += 4 + get_le(batch.data() + offset, 4);
+                    continue;
+                }
+                if (!map_segment(segment->id + 1, true)) return false;
+                continue;
+            }
+            for (size_t done = 0; done < run;) {
+                ssize_t n = pwrite(segment->fd, batch.data() + offset + done, run - done, segment->used + done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    perror("message log pwrite");
+                    return false;
+                }
+                done += n;
+            }
+            fdatasync(segment->fd);
+
+            LogRecord record;
+            for (size_t at = 0; at < run;) {
+                size_t size = parse(segment->map, segment->used + at, record);
+                if (size == 0) break;
+                index(record, {static_cast<uint32_t>(segments_.size() - 1), static_cast<uint32_t>(segment->used + at), record.seq});
+                at += size;
+            }
+            segment->used += run;
+            offset += run;
+        }
+        return true;
+    }
+
+    void run_writer() {
+        std::string batch;
+        std::deque<std::function<void()>> requests;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stopping_ || !pending_.empty() || !requests_.empty(); });
+                if (stopping_ && pending_.empty() && requests_.empty()) return;
+                batch.swap(pending_);
+                requests.swap(requests_);
+            }
+            if (!batch.empty() && !write_batch(batch)) {
+                std::cerr << "Message log: write failed, history is no longer being stored" << std::endl;
+            }
+            batch.clear();
+            for (auto& request : requests) request();
+            requests.clear();
+        }
+    }
+
+    std::string dir_;
+    size_t history_per_group_;
+    std::vector<Segment> segments_;
+    std::atomic<uint64_t> next_seq_{1};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::string pending_;                          // encoded records not yet handed to the writer
+    std::deque<std::function<void()>> requests_;   // reads to run after the next write
+    bool stopping_ = false;
+    std::thread writer_;
+
+    // Writer-thread indexes into the mapped segments.
+    std::unordered_map<std::string, std::vector<Position>> pending_private_;  // recipient -> undelivered
+    std::unordered_map<std::string, std::deque<Position>> group_history_;     // group -> last N messages
+    std::unordered_map<std::string, uint64_t> last_seen_;                     // user -> seq of their newest record
+    std::unordered_map<std::string, uint64_t> seen_before_login_;             // user -> last_seen_ at their last Login
+};
+
+}  // namespace chat
+
+#endif
@@ -0,0 +1,309 @@
+// Wire protocol shared by server_grp.cpp and client_grp.cpp.
+//
+// Every message on the socket is a frame:
+//
+//     varint length | opcode (1 byte) | payload (length - 1 bytes)
+//
+// The length is an unsigned LEB128 varint and covers the opcode plus payload. Commands that take
+// a name (recipient or group) carry it as a varint-prefixed field followed by the free-form text,
+// so nothing on either side needs to tokenise strings to find where a message starts.
+
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/uio.h>
+
+namespace chat {
+
+// Largest frame (opcode + payload) either side will accept; anything bigger is a protocol error.
+inline constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024;
+inline constexpr size_t MAX_VARINT_BYTES = 5;
+
+enum class Op : uint8_t {
+    // client -> server
+    Username = 1,     // payload: username
+    Password = 2,     // payload: password
+    Broadcast = 3,    // payload: text
+    PrivateMsg = 4,   // payload: field(recipient) text
+    GroupCreate = 5,  // payload: group
+    GroupJoin = 6,    // payload: group
+    GroupLeave = 7,   // payload: group
+    GroupMsg = 8,     // payload: field(group) text
+    GroupHistory = 9, // payload: field(group) count
+    Capabilities = 10,// payload: comma-separated features the client supports (see compression.h)
+
+    // server -> client, payload is always printable text
+    Prompt = 64,
+    AuthOk = 65,
+    AuthFailed = 66,
+    Message = 67,     // something another user sent
+    Info = 68,        // confirmation of the client's own command
+    Error = 69,
+    CapabilitiesAck = 70,  // payload: the features the server enabled
+    Compressed = 71,       // payload: deflated opcode + payload of one frame (see compression.h)
+};
+
+struct Frame {
+    Op op;
+    std::string_view payload;  // valid until the parser is advanced
+};
+
+inline void append_varint(std::string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline size_t varint_size(uint32_t value) {
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+inline void append_field(std::string& out, std::string_view field) {
+    append_varint(out, static_cast<uint32_t>(field.size()));
+    out.append(field);
+}
+
+// Appends one complete frame to out. The body is given in up to two pieces so callers can
+// build "field + text" frames without an intermediate string.
+inline void append_frame(std::string& out, Op op, std::string_view field, std::string_view text) {
+    uint32_t field_size = static_cast<uint32_t>(field.size());
+    append_varint(out, static_cast<uint32_t>(1 + varint_size(field_size) + field.size() + text.size()));
+    out.push_back(static_cast<char>(op));
+    append_field(out, field);
+    out.append(text);
+}
+
+inline void append_frame(std::string& out, Op op, std::string_view text) {
+    append_varint(out, static_cast<uint32_t>(1 + text.size()));
+    out.push_back(static_cast<char>(op));
+    out.append(text);
+}
+
+// Builds a frame whose text is the concatenation of parts, with exactly one allocation.
+inline std::string make_frame(Op op, std::initializer_list<std::string_view> parts) {
+    size_t text_size = 0;
+    for (std::string_view part : parts) text_size += part.size();
+    std::string out;
+    out.reserve(text_size + 1 + MAX_VARINT_BYTES);
+    append_varint(out, static_cast<uint32_t>(1 + text_size));
+    out.push_back(static_cast<char>(op));
+    for (std::string_view part : parts) out.append(part);
+    return out;
+}
+
+inline std::string make_frame(Op op, std::string_view text) {
+    std::string out;
+    out.reserve(text.size() + 1 + MAX_VARINT_BYTES);
+    append_frame(out, op, text);
+    return out;
+}
+
+// Decodes a varint from the front of in. Returns false if in is truncated or the value is malformed.
+inline bool read_varint(std::string_view& in, uint32_t& value) {
+    value = 0;
+    for (size_t i = 0; i < in.size() && i < MAX_VARINT_BYTES; ++i) {
+        uint8_t byte = static_cast<uint8_t>(in[i]);
+        value |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            in.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Splits "field(name) text" payloads. Returns false if the payload is malformed.
+inline bool read_field(std::string_view& in, std::string_view& field) {
+    uint32_t len;
+    if (!read_varint(in, len) || len > in.size()) return false;
+    field = in.substr(0, len);
+    in.remove_prefix(len);
+    return true;
+}
+
+// Power-of-two ring buffer that the socket reads straight into. Data is only copied when a
+// frame happens to straddle the wrap-around point.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity = 4096) : data_(round_up(capacity)) {}
+
+    size_t size() const { return tail_ - head_; }
+    size_t capacity() const { return data_.size(); }
+    size_t free_space() const { return capacity() - size(); }
+
+    // Fills iov with the (at most two) free regions, for readv(). Returns the iovec count.
+    int writable_regions(iovec iov[2]) {
+        size_t mask = capacity() - 1;
+        size_t start = tail_ & mask;
+        size_t free = free_space();
+        size_t first = std::min(free, capacity() - start);
+        iov[0] = {data_.data() + start, first};
+        if (first == free) return first ? 1 : 0;
+        iov[1] = {data_.data(), free - first};
+        return 2;
+    }
+
+    void commit(size_t n) { tail_ += n; }
+    void consume(size_t n) { head_ += n; }
+
+    // Returns a view of [offset, offset + n) relative to head, copying into scratch if it wraps.
+    std::string_view view(size_t offset, size_t n, std::string& scratch) const {
+        size_t mask = capacity() - 1;
+        size_t start = (head_ + offset) & mask;
+        if (start + n <= capacity()) {
+            return std::string_view(data_.data() + start, n);
+        }
+        size_t first = capacity() - start;
+        scratch.assign(data_.data() + start, first);
+        scratch.append(data_.data(), n - first);
+        return scratch;
+    }
+
+    // Grows the buffer (preserving contents) so that at least min_free bytes can be written.
+    void reserve_free(size_t min_free) {
+        if (free_space() >= min_free) return;
+        std::vector<char> bigger(round_up(size() + min_free));
+        std::string scratch;
+        std::string_view current = view(0, size(), scratch);
+        std::memcpy(bigger.data(), current.data(), current.size());
+        tail_ = current.size();
+        head_ = 0;
+        data_.swap(bigger);
+    }
+
+private:
+    static size_t round_up(size_t n) {
+        size_t c = 64;
+        while (c < n) c <<= 1;
+        return c;
+    }
+
+    std::vector<char> data_;
+    size_t head_ = 0;  // monotonically increasing; masked on access
+    size_t tail_ = 0;
+};
+
+// Pulls complete frames out of a RingBuffer. Partial frames stay buffered until the rest arrives,
+// so one read can yield many frames and one frame can span many reads.
+class FrameParser {
+public:
+    enum class Result { Frame, NeedMore, Error };
+
+    explicit FrameParser(RingBuffer& buffer, uint32_t max_frame = MAX_FRAME_SIZE) : buffer_(buffer), max_frame_(max_frame) {}
+
+    // Forgets the last frame handed out, for when the buffer has been emptied underneath.
+    void reset() { pending_consume_ = 0; }
+
+    // On Frame, frame.payload stays valid until the next call.
+    Result next(Frame& frame) {
+        buffer_.consume(pending_consume_);
+        pending_consume_ = 0;
+
+        std::string_view header = buffer_.view(0, std::min(buffer_.size(), MAX_VARINT_BYTES), scratch_);
+        std::string_view rest = header;
+        uint32_t length;
+        if (!read_varint(rest, length)) {
+            if (header.size() >= MAX_VARINT_BYTES) return Result::Error;
+            return Result::NeedMore;
+        }
+        if (length == 0 || length > max_frame_) return Result::Error;
+
+        size_t header_size = header.size() - rest.size();
+        if (buffer_.size() < header_size + length) {
+            // Make sure the whole frame will fit once it arrives.
+            buffer_.reserve_free(header_size + length - buffer_.size());
+            return Result::NeedMore;
+        }
+
+        std::string_view body = buffer_.view(header_size, length, scratch_);
+        frame.op = static_cast<Op>(body[0]);
+        frame.payload = body.substr(1);
+        pending_consume_ = header_size + length;
+        return Result::Frame;
+    }
+
+private:
+    RingBuffer& buffer_;
+    uint32_t max_frame_;
+    std::string scratch_;
+    size_t pending_consume_ = 0;
+};
+
+// Translates a line typed by the user ("/msg bob hi", "/group join g1", ...) into a frame.
+// Returns false, with a message in error, when the line is not a valid command.
+inline bool encode_command(std::string_view line, std::string& out, std::string& error) {
+    auto next_word = [](std::string_view& s) {
+        size_t start = s.find_first_not_of(' ');
+        if (start == std::string_view::npos) {
+            s = {};
+            return std::string_view{};
+        }
+        s.remove_prefix(start);
+        size_t end = s.find(' ');
+        std::string_view word = s.substr(0, end);
+        s.remove_prefix(end == std::string_view::npos ? s.size() : end);
+        return word;
+    };
+    auto text_of = [](std::string_view s) {
+        if (!s.empty() && s[0] == ' ') s.remove_prefix(1);
+        return s;
+    };
+
+    std::string_view rest = line;
+    std::string_view command = next_word(rest);
+
+    if (command == "/group") {
+        std::string_view sub = next_word(rest);
+        if (sub == "create" || sub == "create_group") command = "/create_group";
+        else if (sub == "join" || sub == "join_group") command = "/join_group";
+        else if (sub == "leave" || sub == "leave_group") command = "/leave_group";
+        else if (sub == "msg" || sub == "group_msg") command = "/group_msg";
+        else if (sub == "history" || sub == "group_history") command = "/group_history";
+        else {
+            error = "Invalid group command.";
+            return false;
+        }
+    }
+
+    if (command == "/broadcast") {
+        append_frame(out, Op::Broadcast, text_of(rest));
+    } else if (command == "/msg") {
+        std::string_view recipient = next_word(rest);
+        append_frame(out, Op::PrivateMsg, recipient, text_of(rest));
+    } else if (command == "/create_group") {
+        append_frame(out, Op::GroupCreate, next_word(rest));
+    } else if (command == "/join_group") {
+        append_frame(out, Op::GroupJoin, next_word(rest));
+    } else if (command == "/leave_group") {
+        append_frame(out, Op::GroupLeave, next_word(rest));
+    } else if (command == "/group_msg") {
+        std::string_view group = next_word(rest);
+        append_frame(out, Op::GroupMsg, group, text_of(rest));
+    } else if (command == "/group_history") {
+        std::string_view group = next_word(rest);
+        std::string_view count = next_word(rest);
+        append_frame(out, Op::GroupHistory, group, count);
+    } else {
+        error = "Invalid command.";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace chat
+
+#endif
@@ -1,293 +1,2128 @@
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <thread>
-#include <mutex>
-#include <unordered_map>
-#include <vector>
-#include <sstream>
-#include <cstdlib>
-#include <cstring>
-#include <unistd.h>
-// #include <winsock2.h>
-// #include <ws2tcpip.h>
-#include <arpa/inet.h>
-#include <algorithm>
-
-#define PORT 12345
-#define BUFFER_SIZE 1024
-
-// We are using the following lines of code to store usernames and passwords, mapping them
-std::unordered_map<std::string, std::string> users; 
-std::unordered_map<int, std::string> client_usernames; 
-std::unordered_map<std::string, int> username_to_socket; 
-std::unordered_map<std::string, std::vector<std::string>> groups; 
-std::vector<int> clients; 
-std::mutex clients_mutex; 
-
-// using the following fun to load users from text file provided in github repository
-void load_users() {
-    std::ifstream file("users.txt");
-    if (!file) {
-        std::cerr << "Error: Could not open users.txt!" << std::endl;
-        exit(1);
-    }
-
-    std::string line;
-    while (std::getline(file, line)) {
-        size_t delimiter_pos = line.find(':');
-        if (delimiter_pos != std::string::npos) {
-            std::string username = line.substr(0, delimiter_pos);
-            std::string password = line.substr(delimiter_pos + 1);
-            users[username] = password;
-        } else {
-            std::cerr << "Warning: Invalid line in users.txt (missing colon): " << line << std::endl;
-        }
-    }
-}
-
-
-bool authenticate_user(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    send(client_socket, "Enter username: ", 17, 0);
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    std::string username = buffer;
-
-    send(client_socket, "Enter password: ", 17, 0);
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    std::string password = buffer;
-
-    if (users.find(username) != users.end() && users[username] == password) {
-        client_usernames[client_socket] = username;
-        username_to_socket[username] = client_socket;
-        send(client_socket, "Welcome to the server!", 23, 0);
-        return true;
-    }
-    send(client_socket, "Authentication failed", 22, 0);
-    return false;
-}
-
-// Next few functions will be used to send, broadcast messages, in the group or privately  
-void broadcast_message(const std::string& message, int sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (int client : clients) {
-        if (client != sender_socket) {
-            send(client, message.c_str(), message.size(), 0);
-        }
-    }
-}
-
-
-void send_private_message(const std::string& recipient, const std::string& message, int sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (username_to_socket.find(recipient) != username_to_socket.end()) {
-        int recipient_socket = username_to_socket[recipient];
-        std::string private_message = "[" + client_usernames[sender_socket] + "] " + message;
-        send(recipient_socket, private_message.c_str(), private_message.size(), 0);
-    } else {
-        std::string error_message = "User " + recipient + " not found.";
-        send(sender_socket, error_message.c_str(), error_message.size(), 0);
-    }
-}
-
-
-void send_group_message(const std::string& group_name, const std::string& message, int sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) != groups.end()) {
-        std::string sender_username = client_usernames[sender_socket];
-        std::string group_message = "[Group " + group_name + " from " + sender_username + "] " + message;
-
-        for (const std::string& member : groups[group_name]) {
-            if (username_to_socket.find(member) != username_to_socket.end()) {
-                int member_socket = username_to_socket[member];
-                send(member_socket, group_message.c_str(), group_message.size(), 0);
-            }
-        }
-    } else {
-        std::string error_message = "Group " + group_name + " not found.";
-        send(sender_socket, error_message.c_str(), error_message.size(), 0);
-    }
-}
-
-
-void create_group(const std::string& group_name, const std::string& username) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) == groups.end()) {
-        groups[group_name] = {username}; // Create group with the creator as the first member
-        std::string success_message = "Group " + group_name + " created successfully.";
-        send(username_to_socket[username], success_message.c_str(), success_message.size(), 0);
-    } else {
-        std::string error_message = "Group " + group_name + " already exists.";
-        send(username_to_socket[username], error_message.c_str(), error_message.size(), 0);
-    }
-}
-
-
-void join_group(const std::string& group_name, const std::string& username) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) != groups.end()) {
-        auto& members = groups[group_name];
-        if (std::find(members.begin(), members.end(), username) == members.end()) {
-            members.push_back(username); // Add user to the group
-            std::string success_message = "You have joined group " + group_name + ".";
-            send(username_to_socket[username], success_message.c_str(), success_message.size(), 0);
-        } else {
-            std::string error_message = "You are already a member of group " + group_name + ".";
-            send(username_to_socket[username], error_message.c_str(), error_message.size(), 0);
-        }
-    } else {
-        std::string error_message = "Group " + group_name + " not found.";
-        send(username_to_socket[username], error_message.c_str(), error_message.size(), 0);
-    }
-}
-
-
-void leave_group(const std::string& group_name, const std::string& username) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) != groups.end()) {
-        auto& members = groups[group_name];
-        auto it = std::find(members.begin(), members.end(), username);
-        if (it != members.end()) {
-            members.erase(it); // Remove user from the group
-            std::string success_message = "You have left group " + group_name + ".";
-            send(username_to_socket[username], success_message.c_str(), success_message.size(), 0);
-        } else {
-            std::string error_message = "You are not a member of group " + group_name + ".";
-            send(username_to_socket[username], error_message.c_str(), error_message.size(), 0);
-        }
-    } else {
-        std::string error_message = "Group " + group_name + " not found.";
-        send(username_to_socket[username], error_message.c_str(), error_message.size(), 0);
-    }
-}
-
-// We will use following function to handle clients
-
-void handle_client(int client_socket) {
-    if (!authenticate_user(client_socket)) {
-        close(client_socket);
-        return;
-    }
-
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.push_back(client_socket);
-    }
-
-    char buffer[BUFFER_SIZE];
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            break;
-        }
-
-        std::string message(buffer);
-        std::istringstream iss(message);
-        std::string command;
-        iss >> command;
-
-        if (command == "/broadcast") {
-            std::string broadcast_msg;
-            std::getline(iss, broadcast_msg);
-            broadcast_msg = client_usernames[client_socket] + ": " + broadcast_msg.substr(1); 
-            broadcast_message(broadcast_msg, client_socket);
-        } else if (command == "/msg") {
-            std::string recipient, private_message;
-            iss >> recipient;
-            std::getline(iss, private_message);
-            private_message = private_message.substr(1); 
-            send_private_message(recipient, private_message, client_socket);
-        } else if (command == "/group") {
-            std::string subcommand, group_name;
-            iss >> subcommand;
-            if (subcommand == "create" || subcommand == "create_group") {
-                iss >> group_name;
-                create_group(group_name, client_usernames[client_socket]);
-            } else if (subcommand == "join" || subcommand == "join_group") {
-                iss >> group_name;
-                join_group(group_name, client_usernames[client_socket]);
-            } else if (subcommand == "leave" || subcommand == "leave_group") {
-                iss >> group_name;
-                leave_group(group_name, client_usernames[client_socket]);
-            } else if (subcommand == "msg" || subcommand == "group_msg") {
-                iss >> group_name;
-                std::string group_message;
-                std::getline(iss, group_message);
-                group_message = group_message.substr(1); 
-                send_group_message(group_name, group_message, client_socket);
-            } else {
-                std::string error_message = "Invalid group command.";
-                send(client_socket, error_message.c_str(), error_message.size(), 0);
-            }
-        } else if (command == "/create_group") {
-            std::string group_name;
-            iss >> group_name;
-            create_group(group_name, client_usernames[client_socket]);
-        } else if (command == "/join_group") {
-            std::string group_name;
-            iss >> group_name;
-            join_group(group_name, client_usernames[client_socket]);
-        } else if (command == "/group_msg") {
-            std::string group_name, group_message;
-            iss >> group_name;
-            std::getline(iss, group_message);
-            group_message = group_message.substr(1); 
-            send_group_message(group_name, group_message, client_socket);
-        } else if (command == "/leave_group") {
-            std::string group_name;
-            iss >> group_name;
-            leave_group(group_name, client_usernames[client_socket]);
-        } else {
-            std::string error_message = "Invalid command.";
-            send(client_socket, error_message.c_str(), error_message.size(), 0);
-        }
-    }
-
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients.erase(std::remove(clients.begin(), clients.end(), client_socket), clients.end());
-        username_to_socket.erase(client_usernames[client_socket]);
-        client_usernames.erase(client_socket);
-    }
-    close(client_socket);
-}
-
-int main() {
-    // WSADATA wsaData;
-    // WSAStartup(MAKEWORD(2, 2), &wsaData);
-
-    load_users();
-
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        std::cerr << "Failed to create socket" << std::endl;
-        return 1;
-    }
-
-    sockaddr_in server_address{};
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(PORT);
-
-    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        std::cerr << "Bind failed" << std::endl;
-        return 1;
-    }
-
-    listen(server_socket, 5);
-    std::cout << "Server listening on port " << PORT << std::endl;
-
-    while (true) {
-        sockaddr_in client_address;
-        socklen_t client_len = sizeof(client_address);
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_len);
-        if (client_socket >= 0) {
-            std::thread(handle_client, client_socket).detach();
-        }
-    }
-    // WSACleanup();
-    return 0;
-}
\ No newline at end of file
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <csignal>
+// #include <winsock2.h>
+// #include <ws2tcpip.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include "protocol.h"
+#include "message_log.h"
+#include "credentials.h"
+#include "cluster_bus.h"
+#include "compression.h"
+#include "handoff.h"
+
+#define PORT 12345
+#define MAX_EVENTS 256
+#define MAX_IOV 64
+
+struct Reactor;
+struct UserRecord;
+
+using UserId = uint32_t;
+
+// What to do with a client whose outbound queue is full because it is not reading fast enough.
+enum class SlowConsumerPolicy {
+    Drop,        // discard the new message
+    Disconnect,  // close the connection
+    Coalesce,    // replace everything still queued with a single "N messages skipped" notice
+};
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// An encoded frame, immutable once built. Fan-out shares one of these between every recipient's
+// queue; the bytes are freed when the last socket has written them.
+struct EncodedFrame {
+    std::string bytes;
+    uint64_t created_ns;  // for the send-latency histogram
+
+    EncodedFrame(std::string encoded, uint64_t created) : bytes(std::move(encoded)), created_ns(created) {}
+
+    // What to send to a client that negotiated compression. The first such recipient compresses,
+    // every other one shares the result; small or incompressible frames go out as they are.
+    const std::string& compressed_bytes() const;
+
+private:
+    mutable std::once_flag compress_once_;
+    mutable std::string compressed_;
+};
+using SharedFrame = std::shared_ptr<const EncodedFrame>;
+
+SharedFrame make_shared_frame(chat::Op op, std::initializer_list<std::string_view> parts) {
+    return std::make_shared<const EncodedFrame>(chat::make_frame(op, parts), now_ns());
+}
+
+struct ServerConfig {
+    int reactor_count = 0;
+    std::string users_file = "users.txt";
+    std::string stats_socket = "/tmp/server_grp.stats";  // empty disables the endpoint
+    size_t max_queue_bytes = 1 << 20;
+    SlowConsumerPolicy slow_consumer = SlowConsumerPolicy::Drop;
+    std::string log_dir = "chat_log";  // empty disables history and offline delivery
+    int auth_threads = 0;               // password verification workers; 0 = half the reactors
+    size_t auth_queue = 1024;           // logins waiting for a worker before new ones are refused
+    std::string build_index;            // if set, write a hashed index of users_file here and exit
+    uint32_t kdf_iterations = 100000;   // PBKDF2 cost for --build-index
+    int port = 0;                       // 0 = PORT + node_id
+    int node_id = 0;
+    int node_count = 1;                 // more than 1 joins the other nodes over the cluster bus
+    std::string cluster_dir = "/tmp/server_grp.cluster";
+    bool compression = true;            // honour clients that ask for deflate
+    size_t compress_min_bytes = 256;    // smaller frames are never worth compressing
+    double drain_timeout = 10;          // seconds a SIGTERM drain waits for queues to empty
+    std::string handoff_socket = "/tmp/server_grp.handoff";  // a successor connects here; empty disables
+    std::string takeover;               // hand-off socket of a running server to take over from
+};
+
+ServerConfig config;
+
+// ---------------------------------------------------------------------------------------------
+// Metrics. Every thread records into its own Metrics block; nothing is shared on the hot path.
+// The stats endpoint sums all blocks when it is scraped.
+
+// Single-writer counter: only the owning thread updates it, so a relaxed load + store is enough
+// (no locked instruction), and readers on other threads still see a consistent 64-bit value.
+struct Counter {
+    std::atomic<uint64_t> value{0};
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Log-linear histogram, 8 sub-buckets per power of two (values reported within ~12%).
+struct Histogram {
+    static constexpr int SUB_BITS = 3;
+    static constexpr int BUCKETS = 64 << SUB_BITS;
+
+    Counter counts[BUCKETS];
+    Counter sum;
+
+    static int index_of(uint64_t v) {
+        if (v < (1u << SUB_BITS)) return static_cast<int>(v);
+        int exponent = 63 - __builtin_clzll(v);
+        int sub = static_cast<int>((v >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+        return ((exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+
+    static uint64_t upper_bound_of(int index) {
+        if (index < (1 << SUB_BITS)) return index;
+        int exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+        uint64_t sub = index & ((1 << SUB_BITS) - 1);
+        return ((uint64_t(1) << SUB_BITS | sub) + 1) << (exponent - SUB_BITS);
+    }
+
+    void record(uint64_t v) {
+        counts[index_of(v)].add();
+        sum.add(v);
+    }
+};
+
+enum CommandType { CmdBroadcast, CmdPrivate, CmdGroupCreate, CmdGroupJoin, CmdGroupLeave, CmdGroupMsg, CmdGroupHistory, CmdInvalid, CMD_TYPES };
+const char* const command_names[CMD_TYPES] = {"broadcast", "msg", "group_create", "group_join", "group_leave", "group_msg", "group_history", "invalid"};
+
+struct Metrics {
+    Counter connections_accepted;
+    Counter connections_closed;
+    Counter logins;
+    Counter logouts;
+    Counter auth_failures;
+    Counter auth_busy;             // logins refused because the verification queue was full
+    Counter credential_reloads;
+    Counter credential_reload_failures;
+    Counter bus_messages_in;
+    Counter throttled[CMD_TYPES];
+    Counter frames_compressed;     // once per frame, however many recipients share it
+    Counter compression_saved_bytes;
+    Counter rate_limit_disconnects;
+    Counter commands[CMD_TYPES];
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter frames_out;
+    Counter slow_consumer_dropped;
+    Counter slow_consumer_disconnected;
+    Counter slow_consumer_coalesced;
+    Histogram fanout;              // recipients per broadcast / group message
+    Histogram queue_depth_bytes;   // recipient's queued bytes right after an enqueue
+    Histogram send_latency_ns;     // frame encoded -> fully handed to the kernel, per recipient
+    Histogram auth_wait_ns;        // password frame parsed -> verification started
+    Histogram auth_verify_ns;      // time spent in the KDF
+};
+
+std::mutex metrics_registry_mutex;
+std::vector<Metrics*> metrics_registry;  // one per thread that ever recorded anything; never freed
+
+// The calling thread's Metrics block, created and registered on first use.
+Metrics& local_metrics() {
+    thread_local Metrics* mine = [] {
+        auto* created = new Metrics();
+        std::lock_guard<std::mutex> lock(metrics_registry_mutex);
+        metrics_registry.push_back(created);
+        return created;
+    }();
+    return *mine;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Rate limiting. Token buckets, refilled lazily from the monotonic clock when they are checked:
+// one per command type on each connection (touched only by the owning reactor, so unlocked) and
+// one per user across all their commands (behind that user's own mutex). A check is a few
+// arithmetic operations; there is no shared state between users.
+
+struct RateLimit {
+    double rate = 0;   // tokens per second; 0 means unlimited
+    double burst = 0;  // bucket size
+};
+
+RateLimit command_limits[CMD_TYPES] = {
+    {5, 10},     // broadcast: fans out to everyone, so the tightest
+    {50, 100},   // msg
+    {5, 20},     // group_create
+    {5, 20},     // group_join
+    {5, 20},     // group_leave
+    {20, 50},    // group_msg
+    {2, 5},      // group_history
+    {10, 20},    // invalid
+};
+RateLimit user_limit{100, 200};
+uint32_t limit_disconnect_after = 1000;  // consecutive throttled commands before we hang up; 0 = never
+
+struct TokenBucket {
+    double tokens = -1;  // negative until first use, then starts full
+    uint64_t last_ns = 0;
+
+    bool take(const RateLimit& limit, uint64_t now) {
+        if (limit.rate <= 0) return true;
+        if (tokens < 0) tokens = limit.burst;
+        else tokens = std::min(limit.burst, tokens + (now - last_ns) * 1e-9 * limit.rate);
+        last_ns = now;
+        if (tokens < 1) return false;
+        tokens -= 1;
+        return true;
+    }
+};
+
+const std::string& EncodedFrame::compressed_bytes() const {
+    if (bytes.size() < config.compress_min_bytes) return bytes;
+    std::call_once(compress_once_, [&] {
+        std::string_view body = bytes;
+        uint32_t length;
+        chat::read_varint(body, length);
+        compressed_ = chat::compress_frame(body, bytes.size());
+        if (!compressed_.empty()) {
+            Metrics& metrics = local_metrics();
+            metrics.frames_compressed.add();
+            metrics.compression_saved_bytes.add(bytes.size() - compressed_.size());
+        }
+    });
+    return compressed_.empty() ? bytes : compressed_;
+}
+
+// A frame in one client's queue, and which encoding of it that client gets.
+struct QueuedFrame {
+    SharedFrame frame;
+    const std::string* bytes;  // frame->bytes or frame->compressed_bytes()
+};
+
+// Every accepted socket gets one of these. It is owned by the reactor that accepted it;
+// other reactors only touch it through send_message(), which serialises on out_mutex.
+struct Client {
+    enum class State { AwaitUsername, AwaitPassword, Verifying, Authenticated, Rejected };
+
+    int socket;
+    Reactor* owner;
+    State state = State::AwaitUsername;
+    std::string pending_username;
+    std::shared_ptr<UserRecord> user;  // set once by the owner before the session is published, read-only afterwards
+
+    chat::RingBuffer inbound;  // raw bytes from the socket, parsed into frames in place
+    chat::FrameParser parser{inbound};
+    TokenBucket limits[CMD_TYPES];     // owner only
+    uint32_t throttled_streak = 0;     // owner only: commands rejected since the last accepted one
+
+    // Outbound side. Any thread may enqueue; only the owning reactor writes to the socket.
+    std::mutex out_mutex;
+    std::atomic<bool> compress{false};  // negotiated through Op::Capabilities; read by any sender
+    std::deque<QueuedFrame> out_queue;  // whole encoded frames, possibly shared with other clients
+    size_t out_offset = 0;              // bytes of out_queue.front() already written
+    size_t out_bytes = 0;               // unwritten bytes across the queue
+    size_t skipped = 0;                 // messages dropped or coalesced away since the last notice
+    bool flush_scheduled = false;       // already on the owner's pending list
+    bool write_blocked = false;         // last writev hit EAGAIN; EPOLLOUT will resume it
+    bool close_when_flushed = false;
+    bool kill = false;                  // slow-consumer policy asked the owner to drop us
+    bool closed = false;
+
+    Client(int fd, Reactor* reactor) : socket(fd), owner(reactor) {}
+
+    UserId user_id() const;
+};
+
+// One epoll instance, one listening socket (SO_REUSEPORT) and one thread, pinned to a core.
+// A reactor that took over from an older process may hold more than one listening socket.
+struct Reactor {
+    int id;
+    int epoll_fd = -1;
+    std::vector<int> listen_fds;
+    bool draining = false;
+    int event_fd = -1;  // other threads poke this after queueing output for one of our clients
+    std::unordered_map<int, std::shared_ptr<Client>> connections;  // only touched by this reactor's thread
+
+    std::mutex pending_mutex;
+    std::vector<std::shared_ptr<Client>> pending_flush;
+    std::vector<std::pair<std::shared_ptr<Client>, bool>> pending_logins;  // verified by the auth pool
+};
+
+// Hash map split into independently locked shards. Lookups take a shared lock on one shard,
+// so readers never contend with each other and writers only contend within a shard.
+template <typename Value, size_t ShardCount = 64>
+class ShardedMap {
+public:
+    // Returns a copy of the value (a shared_ptr in practice), or an empty one.
+    Value find(const std::string& key) const {
+        const Shard& shard = shard_for(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+        return it == shard.map.end() ? Value{} : it->second;
+    }
+
+    void assign(const std::string& key, Value value) {
+        Shard& shard = shard_for(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.map[key] = std::move(value);
+    }
+
+    // Returns false if the key was already present.
+    bool insert(const std::string& key, Value value) {
+        Shard& shard = shard_for(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.map.emplace(key, std::move(value)).second;
+    }
+
+    // Erases the key only if it still maps to expected.
+    bool erase_if_equal(const std::string& key, const Value& expected) {
+        Shard& shard = shard_for(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end() || it->second != expected) return false;
+        shard.map.erase(it);
+        return true;
+    }
+
+    // Returns the existing value, or inserts and returns make() if the key is absent.
+    template <typename Make>
+    Value find_or_insert(const std::string& key, Make make) {
+        Shard& shard = shard_for(key);
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.map.find(key);
+            if (it != shard.map.end()) return it->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        auto [it, inserted] = shard.map.try_emplace(key);
+        if (inserted) it->second = make();
+        return it->second;
+    }
+
+    // Visits every entry, one shard at a time under that shard's shared lock.
+    void for_each(const std::function<void(const std::string&, const Value&)>& visit) const {
+        for (const Shard& shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& [key, value] : shard.map) visit(key, value);
+        }
+    }
+
+private:
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, Value> map;
+    };
+
+    Shard& shard_for(const std::string& key) { return shards_[std::hash<std::string>{}(key) % ShardCount]; }
+    const Shard& shard_for(const std::string& key) const { return shards_[std::hash<std::string>{}(key) % ShardCount]; }
+
+    Shard shards_[ShardCount];
+};
+
+// Membership is kept as interned user ids, plus a dense array of the sessions of members who
+// are online right now. Fan-out walks that array; join, leave, login and logout are O(1).
+struct Group {
+    std::string name;
+    std::shared_mutex mutex;
+    std::unordered_set<UserId> members;
+    std::vector<std::shared_ptr<Client>> live;
+    std::unordered_map<UserId, size_t> live_index;  // member id -> position in live
+    std::vector<uint32_t> node_live = std::vector<uint32_t>(config.node_count);  // online members per cluster node
+
+    // Caller holds mutex exclusively.
+    void attach(UserId id, const std::shared_ptr<Client>& session) {
+        auto [it, inserted] = live_index.try_emplace(id, live.size());
+        if (inserted) live.push_back(session);
+        else live[it->second] = session;
+    }
+
+    // Caller holds mutex exclusively. Swap-with-last keeps live dense.
+    void detach(UserId id) {
+        auto it = live_index.find(id);
+        if (it == live_index.end()) return;
+        size_t slot = it->second;
+        live_index.erase(it);
+        if (slot != live.size() - 1) {
+            live[slot] = std::move(live.back());
+            live_index[live[slot]->user_id()] = slot;
+        }
+        live.pop_back();
+    }
+};
+
+// One per distinct username, created on first use and never freed, so a UserRecord pointer (or
+// its id) is a stable interned handle. Lock order: UserRecord::mutex before Group::mutex.
+struct UserRecord {
+    UserId id;
+    std::string name;
+
+    std::mutex mutex;
+    std::shared_ptr<Client> session;                      // current live connection, if any
+    std::unordered_set<std::shared_ptr<Group>> groups;    // reverse index: groups this user is in
+    int remote_node = -1;                                 // cluster node holding their session, if another one
+
+    std::mutex limit_mutex;   // only guards bucket, so rate checks never wait on membership edits
+    TokenBucket bucket;       // all commands from this user, across connections
+
+    UserRecord(UserId user_id, std::string user_name) : id(user_id), name(std::move(user_name)) {}
+};
+
+// We are using the following lines of code to store usernames and salted password hashes.
+// Each loaded table is an immutable snapshot. A reload builds a new one in the background and
+// publishes it with one atomic pointer swap; readers take a reference to whichever snapshot is
+// current and keep it for the whole check, so they never lock and never see a half-built table.
+std::atomic<std::shared_ptr<const chat::CredentialIndex>> credentials;
+ShardedMap<std::shared_ptr<UserRecord>> user_ids;  // username -> interned record
+ShardedMap<std::shared_ptr<Client>> sessions;      // username -> live authenticated connection
+ShardedMap<std::shared_ptr<Group>> groups;         // group name -> members
+std::atomic<UserId> next_user_id{0};
+
+// Durable history (see message_log.h); null when --log-dir is empty. Group messages and private
+// messages to offline users are appended on the send path, which only copies them into the log's
+// batch; the log's writer thread does all the disk I/O and serves replay and history reads.
+std::unique_ptr<chat::MessageLog> message_log;
+
+// Link to the other server processes; null when running as a single node (see cluster_bus.h).
+std::unique_ptr<chat::Bus> bus;
+
+UserId Client::user_id() const { return user->id; }
+
+std::shared_ptr<UserRecord> intern_user(const std::string& name) {
+    return user_ids.find_or_insert(name, [&] { return std::make_shared<UserRecord>(next_user_id++, name); });
+}
+
+std::shared_ptr<Group> find_or_create_group(const std::string& name) {
+    return groups.find_or_insert(name, [&] {
+        auto created = std::make_shared<Group>();
+        created->name = name;
+        return created;
+    });
+}
+
+// Membership edits shared by local commands, log replay and the cluster bus. The caller holds
+// user.mutex and group->mutex exclusively. Both return false if nothing changed.
+bool link_member(UserRecord& user, const std::shared_ptr<Group>& group) {
+    if (!group->members.insert(user.id).second) return false;
+    if (user.session) group->attach(user.id, user.session);
+    if (user.remote_node >= 0) ++group->node_live[user.remote_node];
+    user.groups.insert(group);
+    return true;
+}
+
+bool unlink_member(UserRecord& user, const std::shared_ptr<Group>& group) {
+    if (!group->members.erase(user.id)) return false;
+    group->detach(user.id);
+    if (user.remote_node >= 0) --group->node_live[user.remote_node];
+    user.groups.erase(group);
+    return true;
+}
+
+// Reads plaintext user:password lines, as in the users.txt provided in the github repository.
+bool read_plaintext_users(std::vector<std::pair<std::string, std::string>>& entries) {
+    std::ifstream file(config.users_file);
+    if (!file) {
+        std::cerr << "Error: Could not open " << config.users_file << "!" << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t delimiter_pos = line.find(':');
+        if (delimiter_pos != std::string::npos && delimiter_pos <= UINT16_MAX) {
+            entries.emplace_back(line.substr(0, delimiter_pos), line.substr(delimiter_pos + 1));
+        } else {
+            std::cerr << "Warning: Invalid line in " << config.users_file << " (missing colon): " << line << std::endl;
+        }
+    }
+    return true;
+}
+
+// A prebuilt index (see --build-index) is mapped as is; a plaintext file is hashed into the same
+// format in memory. Publishes the new table and returns true, or leaves the current one in place.
+bool load_users() {
+    auto index = std::make_shared<chat::CredentialIndex>();
+    bool loaded;
+    if (chat::CredentialIndex::is_index_file(config.users_file)) {
+        loaded = index->open_file(config.users_file);
+        if (!loaded) std::cerr << "Error: " << config.users_file << " is not a valid credential index!" << std::endl;
+    } else {
+        std::vector<std::pair<std::string, std::string>> entries;
+        loaded = read_plaintext_users(entries) && index->open_memory(chat::CredentialIndex::build(entries, 1));
+    }
+    if (!loaded) return false;
+    std::cout << "Loaded " << index->size() << " users from " << config.users_file << std::endl;
+    credentials.store(std::move(index));
+    return true;
+}
+
+// Reloads the users file on SIGHUP, or when it is rewritten or replaced (inotify watches the
+// directory, so editors that save via rename are caught too). SIGHUP is blocked in every thread
+// and read here through a signalfd. Sessions that are already logged in are not affected.
+void run_credential_watcher() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    std::string path = config.users_file;
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash == 0 ? 1 : slash);
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        perror("inotify_add_watch");
+    }
+
+    pollfd fds[2] = {{signal_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        bool reload = false;
+        if (fds[0].revents & POLLIN) {
+            signalfd_siginfo info;
+            ssize_t ignored = read(signal_fd, &info, sizeof(info));
+            (void)ignored;
+            reload = true;
+        }
+        if (fds[1].revents & POLLIN) {
+            ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < n;) {
+                auto* event = reinterpret_cast<inotify_event*>(buffer + offset);
+                if (event->len && name == event->name) reload = true;
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (!reload) continue;
+        // Let a burst of writes (or a signal right after a save) settle into one reload.
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        while (poll(fds, 2, 0) > 0) {
+            if (fds[0].revents & POLLIN) {
+                signalfd_siginfo info;
+                ssize_t ignored = read(signal_fd, &info, sizeof(info));
+                (void)ignored;
+            }
+            if (fds[1].revents & POLLIN) {
+                ssize_t ignored = read(inotify_fd, buffer, sizeof(buffer));
+                (void)ignored;
+            }
+        }
+        if (load_users()) local_metrics().credential_reloads.add();
+        else local_metrics().credential_reload_failures.add();
+    }
+}
+
+// Writes a salted, hashed index of the plaintext users file, to be passed to --users later.
+bool build_credential_index() {
+    std::vector<std::pair<std::string, std::string>> entries;
+    if (!read_plaintext_users(entries)) return false;
+    std::vector<char> image = chat::CredentialIndex::build(entries, config.kdf_iterations);
+    std::ofstream out(config.build_index, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out) {
+        std::cerr << "Error: Could not write " << config.build_index << "!" << std::endl;
+        return false;
+    }
+    std::cout << "Wrote credential index " << config.build_index << " (" << config.kdf_iterations << " iterations)" << std::endl;
+    return true;
+}
+
+// Bounded pool that runs password verification off the reactors. A KDF costs milliseconds by
+// design, so a login storm queues here instead of stalling the event loops that serve connected
+// users. When the queue is full new logins are refused outright.
+class AuthPool {
+public:
+    struct Job {
+        std::shared_ptr<Client> client;
+        std::string username;
+        std::string password;
+        uint64_t queued_ns;
+    };
+
+    void start(int thread_count, size_t capacity) {
+        capacity_ = capacity;
+        for (int i = 0; i < thread_count; ++i) std::thread(&AuthPool::run, this).detach();
+    }
+
+    bool submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (jobs_.size() >= capacity_) return false;
+            jobs_.push_back(std::move(job));
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+private:
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Job> jobs_;
+    size_t capacity_ = 0;
+};
+
+AuthPool auth_pool;
+
+
+// Writes as much of the queue as the socket accepts, up to MAX_IOV frames per writev().
+// Runs on the owning reactor with client.out_mutex held; the lock is per connection and the
+// socket is non-blocking, so no sender ever waits on another client's I/O.
+// Returns false if the connection is broken.
+bool flush_locked(Client& client) {
+    while (!client.out_queue.empty()) {
+        iovec iov[MAX_IOV];
+        int count = 0;
+        for (auto it = client.out_queue.begin(); it != client.out_queue.end() && count < MAX_IOV; ++it, ++count) {
+            size_t skip = count == 0 ? client.out_offset : 0;
+            iov[count].iov_base = const_cast<char*>(it->bytes->data()) + skip;
+            iov[count].iov_len = it->bytes->size() - skip;
+        }
+
+        ssize_t n = writev(client.socket, iov, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            client.write_blocked = true;  // EPOLLOUT (edge-triggered) tells the owner when to try again
+            return true;
+        }
+        if (n <= 0) return false;
+
+        Metrics& metrics = local_metrics();
+        metrics.bytes_out.add(n);
+        uint64_t now = now_ns();
+        client.out_bytes -= n;
+        size_t written = n;
+        while (written > 0) {
+            size_t remaining = client.out_queue.front().bytes->size() - client.out_offset;
+            if (written < remaining) {
+                client.out_offset += written;
+                break;
+            }
+            written -= remaining;
+            client.out_offset = 0;
+            metrics.frames_out.add();
+            metrics.send_latency_ns.record(now - client.out_queue.front().frame->created_ns);
+            client.out_queue.pop_front();
+        }
+    }
+    return true;
+}
+
+// Applies the slow-consumer policy when a frame does not fit. Caller holds client.out_mutex.
+// Returns true if the frame may still be queued.
+bool make_room_locked(Client& client, size_t frame_size) {
+    if (client.out_bytes + frame_size <= config.max_queue_bytes) return true;
+
+    switch (config.slow_consumer) {
+    case SlowConsumerPolicy::Drop:
+        ++client.skipped;
+        local_metrics().slow_consumer_dropped.add();
+        return false;
+    case SlowConsumerPolicy::Disconnect:
+        client.kill = true;
+        local_metrics().slow_consumer_disconnected.add();
+        return false;
+    case SlowConsumerPolicy::Coalesce: {
+        // Keep the frame that is partly on the wire, collapse the rest into one notice.
+        size_t keep = client.out_offset > 0 ? 1 : 0;
+        while (client.out_queue.size() > keep) {
+            client.out_bytes -= client.out_queue.back().bytes->size();
+            client.out_queue.pop_back();
+            ++client.skipped;
+        }
+        local_metrics().slow_consumer_coalesced.add(client.skipped);
+        SharedFrame notice = make_shared_frame(chat::Op::Error,
+            {"[server] ", std::to_string(client.skipped), " messages skipped (slow consumer)"});
+        client.skipped = 0;
+        client.out_bytes += notice->bytes.size();
+        client.out_queue.push_back({notice, &notice->bytes});
+        return client.out_bytes + frame_size <= config.max_queue_bytes;
+    }
+    }
+    return false;
+}
+
+// Hands the client to its reactor for flushing. Lock-free for the caller apart from the
+// reactor's short pending-list mutex; the eventfd is only written when the list was empty.
+void schedule_flush(const std::shared_ptr<Client>& client) {
+    Reactor& reactor = *client->owner;
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(reactor.pending_mutex);
+        wake = reactor.pending_flush.empty();
+        reactor.pending_flush.push_back(client);
+    }
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t ignored = write(reactor.event_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Never blocks and never does I/O: the frame is queued (subject to the slow-consumer policy)
+// and the owning reactor writes it out when the socket is writable. Only the pointer is copied.
+void send_frame(const std::shared_ptr<Client>& client, const SharedFrame& frame) {
+    bool schedule = false;
+    const std::string& wire = client->compress.load(std::memory_order_relaxed) ? frame->compressed_bytes() : frame->bytes;
+    {
+        std::lock_guard<std::mutex> lock(client->out_mutex);
+        if (client->closed || client->kill) return;
+        if (make_room_locked(*client, wire.size())) {
+            client->out_bytes += wire.size();
+            client->out_queue.push_back({frame, &wire});
+            local_metrics().queue_depth_bytes.record(client->out_bytes);
+        }
+        if (!client->flush_scheduled && (!client->write_blocked || client->kill)) {
+            client->flush_scheduled = true;
+            schedule = true;
+        }
+    }
+    if (schedule) schedule_flush(client);
+}
+
+void send_message(const std::shared_ptr<Client>& client, chat::Op op, std::string_view text) {
+    send_frame(client, make_shared_frame(op, {text}));
+}
+
+void close_after_flush(const std::shared_ptr<Client>& client) {
+    {
+        std::lock_guard<std::mutex> lock(client->out_mutex);
+        client->close_when_flushed = true;
+        if (client->flush_scheduled) return;
+        client->flush_scheduled = true;
+    }
+    schedule_flush(client);
+}
+
+// Makes a freshly authenticated session visible in every group its user belongs to.
+// Returns those groups, each with the log seq from which its messages reach the session live.
+// The seq is read under the group's lock, which deliver_group_locked logs under too, so each
+// group message is either below it (and replayed) or sent live.
+std::vector<std::pair<std::string, uint64_t>> attach_session(const std::shared_ptr<Client>& client) {
+    UserRecord& user = *client->user;
+    std::vector<std::pair<std::string, uint64_t>> names;
+    std::lock_guard<std::mutex> lock(user.mutex);
+    user.session = client;
+    for (const auto& group : user.groups) {
+        std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+        group->attach(user.id, client);
+        names.emplace_back(group->name, message_log ? message_log->next_seq() : 0);
+    }
+    return names;
+}
+
+// Disconnect cleanup: O(1) per group the user is in, using the reverse index.
+void detach_session(const std::shared_ptr<Client>& client) {
+    UserRecord& user = *client->user;
+    std::lock_guard<std::mutex> lock(user.mutex);
+    if (user.session != client) return;  // a newer login has already taken over
+    user.session.reset();
+    for (const auto& group : user.groups) {
+        std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+        group->detach(user.id);
+    }
+}
+
+// Rebuilds the frame a logged message was originally delivered as, marked with tag.
+SharedFrame record_frame(const chat::LogRecord& record, std::string_view tag) {
+    if (record.type == chat::RecordType::Group) {
+        return make_shared_frame(chat::Op::Message, {tag, "[Group ", record.b, " from ", record.a, "] ", record.c});
+    }
+    return make_shared_frame(chat::Op::Message, {tag, "[", record.a, "] ", record.c});
+}
+
+// Login is a small state machine now: a Username frame followed by a Password frame.
+// Both may arrive in the same read; the prompts are still sent for interactive clients.
+// Returns false if the connection should be dropped.
+bool authenticate_user(const std::shared_ptr<Client>& client, const chat::Frame& frame) {
+    if (client->state == Client::State::AwaitUsername && frame.op == chat::Op::Username) {
+        client->pending_username.assign(frame.payload);
+        client->state = Client::State::AwaitPassword;
+        send_message(client, chat::Op::Prompt, "Enter password: ");
+        return true;
+    }
+
+    if (client->state == Client::State::AwaitPassword && frame.op == chat::Op::Password) {
+        // Frames that follow stay buffered until the pool hands the result back (finish_login).
+        client->state = Client::State::Verifying;
+        if (auth_pool.submit({client, client->pending_username, std::string(frame.payload), now_ns()})) return true;
+        local_metrics().auth_busy.add();
+        send_message(client, chat::Op::AuthFailed, "Server busy, try again later");
+        return false;
+    }
+
+    local_metrics().auth_failures.add();
+    send_message(client, chat::Op::AuthFailed, "Authentication failed");
+    return false;
+}
+
+void AuthPool::run() {
+    // Lower priority than the reactors: on a busy box connected users win the CPU and logins wait.
+    setpriority(PRIO_PROCESS, gettid(), 10);
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [&] { return !jobs_.empty(); });
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        Metrics& metrics = local_metrics();
+        uint64_t started = now_ns();
+        metrics.auth_wait_ns.record(started - job.queued_ns);
+        bool ok = credentials.load()->verify(job.username, job.password);
+        metrics.auth_verify_ns.record(now_ns() - started);
+
+        Reactor& reactor = *job.client->owner;
+        {
+            std::lock_guard<std::mutex> lock(reactor.pending_mutex);
+            reactor.pending_logins.emplace_back(std::move(job.client), ok);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(reactor.event_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Runs on the owning reactor once the auth pool has checked the password.
+// Returns false if the connection should be dropped.
+bool finish_login(const std::shared_ptr<Client>& client, bool ok) {
+    if (!ok) {
+        local_metrics().auth_failures.add();
+        send_message(client, chat::Op::AuthFailed, "Authentication failed");
+        return false;
+    }
+    const std::string& username = client->pending_username;
+    client->state = Client::State::Authenticated;
+    client->user = intern_user(username);
+    sessions.assign(username, client);
+    // Private messages stored before this point are replayed; deliver_private catches later ones.
+    uint64_t until = message_log ? message_log->next_seq() : 0;
+    if (message_log) message_log->append(chat::RecordType::Login, username);
+    std::vector<std::pair<std::string, uint64_t>> user_groups = attach_session(client);
+    if (bus) bus->send_all(chat::BusOp::Presence, {username}, "1");
+    local_metrics().logins.add();
+    send_message(client, chat::Op::AuthOk, "Welcome to the server!");
+    if (message_log) {
+        message_log->request_missed(username, std::move(user_groups), until, [client](const chat::LogRecord& record) {
+            send_frame(client, record_frame(record, "(missed) "));
+        });
+    }
+    return true;
+}
+
+// Next few functions will be used to send, broadcast messages, in the group or privately.
+// Each message is encoded exactly once; every recipient's queue holds a reference to the same bytes.
+// None of them takes a global lock: lookups hit one registry shard, group edits one group.
+// Cross-node traffic goes out once per peer node, never once per remote recipient.
+void deliver_broadcast(std::string_view from, std::string_view message, const std::shared_ptr<Client>& sender) {
+    SharedFrame frame = make_shared_frame(chat::Op::Message, {from, ": ", message});
+    uint64_t recipients = 0;
+    sessions.for_each([&](const std::string&, const std::shared_ptr<Client>& client) {
+        if (client != sender) {
+            send_frame(client, frame);
+            ++recipients;
+        }
+    });
+    local_metrics().fanout.record(recipients);
+}
+
+void broadcast_message(std::string_view message, const std::shared_ptr<Client>& sender) {
+    deliver_broadcast(sender->user->name, message, sender);
+    if (bus) bus->send_all(chat::BusOp::Broadcast, {sender->user->name}, message);
+}
+
+// The node a user is logged in on, if it is another one.
+int remote_node_of(const std::string& name) {
+    std::shared_ptr<UserRecord> user = user_ids.find(name);
+    if (!user) return -1;
+    std::lock_guard<std::mutex> lock(user->mutex);
+    return user->remote_node;
+}
+
+// Delivers to a local session, or stores for later if the user is offline everywhere.
+// Returns false if nobody by that name exists.
+bool deliver_private(std::string_view from, const std::string& recipient, std::string_view message) {
+    if (std::shared_ptr<Client> target = sessions.find(recipient)) {
+        send_frame(target, make_shared_frame(chat::Op::Message, {"[", from, "] ", message}));
+        return true;
+    }
+    if (message_log && credentials.load()->contains(recipient)) {
+        message_log->append(chat::RecordType::Private, from, recipient, message);
+        // The recipient may have logged in since the lookup, with their replay already cut off
+        // below this record. Replays take each stored message once, so asking again is safe.
+        if (std::shared_ptr<Client> target = sessions.find(recipient)) {
+            message_log->request_missed(recipient, {}, message_log->next_seq(), [target](const chat::LogRecord& record) {
+                send_frame(target, record_frame(record, "(missed) "));
+            });
+        }
+        return true;
+    }
+    return false;
+}
+
+// Fans a group message out to this node's online members. Caller holds group.mutex (shared).
+void deliver_group_locked(Group& group, std::string_view from, std::string_view message) {
+    SharedFrame frame = make_shared_frame(chat::Op::Message, {"[Group ", group.name, " from ", from, "] ", message});
+    // Logged under the group lock so a member logging in or out sees it either live or in replay.
+    if (message_log) message_log->append(chat::RecordType::Group, from, group.name, message);
+    for (const std::shared_ptr<Client>& target : group.live) {
+        send_frame(target, frame);
+    }
+    local_metrics().fanout.record(group.live.size());
+}
+
+
+void send_private_message(const std::string& recipient, std::string_view message, const std::shared_ptr<Client>& sender) {
+    if (std::shared_ptr<Client> target = sessions.find(recipient)) {
+        send_frame(target, make_shared_frame(chat::Op::Message, {"[", sender->user->name, "] ", message}));
+        return;
+    }
+    int node = bus ? remote_node_of(recipient) : -1;
+    if (node >= 0) {
+        bus->send(node, chat::BusOp::PrivateMsg, {sender->user->name, recipient}, message);
+    } else if (deliver_private(sender->user->name, recipient, message)) {
+        std::string info_message = "User " + recipient + " is offline; the message will be delivered when they log in.";
+        send_message(sender, chat::Op::Info, info_message);
+    } else {
+        std::string error_message = "User " + recipient + " not found.";
+        send_message(sender, chat::Op::Error, error_message);
+    }
+}
+
+
+void send_group_message(const std::string& group_name, std::string_view message, const std::shared_ptr<Client>& sender) {
+    if (std::shared_ptr<Group> group = groups.find(group_name)) {
+        std::shared_lock<std::shared_mutex> lock(group->mutex);
+        deliver_group_locked(*group, sender->user->name, message);
+        if (bus) {
+            // Only nodes with an online member need it, unless every node keeps the full history.
+            for (int node = 0; node < bus->node_count(); ++node) {
+                if (node != bus->node_id() && (message_log || group->node_live[node] > 0)) {
+                    bus->send(node, chat::BusOp::GroupMsg, {sender->user->name, group_name}, message);
+                }
+            }
+        }
+    } else {
+        std::string error_message = "Group " + group_name + " not found.";
+        send_message(sender, chat::Op::Error, error_message);
+    }
+}
+
+
+void create_group(const std::string& group_name, const std::shared_ptr<Client>& client) {
+    UserRecord& user = *client->user;
+    auto group = std::make_shared<Group>();
+    group->name = group_name;
+    std::lock_guard<std::mutex> lock(user.mutex);
+    if (groups.insert(group_name, group)) {
+        {
+            std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+            link_member(user, group);
+        }
+        if (message_log) message_log->append(chat::RecordType::GroupCreate, user.name, group_name);
+        if (bus) bus->send_all(chat::BusOp::GroupCreate, {user.name}, group_name);
+        std::string success_message = "Group " + group_name + " created successfully.";
+        send_message(client, chat::Op::Info, success_message);
+    } else {
+        std::string error_message = "Group " + group_name + " already exists.";
+        send_message(client, chat::Op::Error, error_message);
+    }
+}
+
+
+void join_group(const std::string& group_name, const std::shared_ptr<Client>& client) {
+    if (std::shared_ptr<Group> group = groups.find(group_name)) {
+        UserRecord& user = *client->user;
+        std::lock_guard<std::mutex> lock(user.mutex);
+        std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+        if (link_member(user, group)) {
+            if (message_log) message_log->append(chat::RecordType::GroupJoin, user.name, group_name);
+            if (bus) bus->send_all(chat::BusOp::GroupJoin, {user.name}, group_name);
+            std::string success_message = "You have joined group " + group_name + ".";
+            send_message(client, chat::Op::Info, success_message);
+        } else {
+            std::string error_message = "You are already a member of group " + group_name + ".";
+            send_message(client, chat::Op::Error, error_message);
+        }
+    } else {
+        std::string error_message = "Group " + group_name + " not found.";
+        send_message(client, chat::Op::Error, error_message);
+    }
+}
+
+
+void leave_group(const std::string& group_name, const std::shared_ptr<Client>& client) {
+    if (std::shared_ptr<Group> group = groups.find(group_name)) {
+        UserRecord& user = *client->user;
+        std::lock_guard<std::mutex> lock(user.mutex);
+        std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+        if (unlink_member(user, group)) {
+            if (message_log) message_log->append(chat::RecordType::GroupLeave, user.name, group_name);
+            if (bus) bus->send_all(chat::BusOp::GroupLeave, {user.name}, group_name);
+            std::string success_message = "You have left group " + group_name + ".";
+            send_message(client, chat::Op::Info, success_message);
+        } else {
+            std::string error_message = "You are not a member of group " + group_name + ".";
+            send_message(client, chat::Op::Error, error_message);
+        }
+    } else {
+        std::string error_message = "Group " + group_name + " not found.";
+        send_message(client, chat::Op::Error, error_message);
+    }
+}
+
+// Sends the last count messages of a group the client belongs to, oldest first.
+void send_group_history(const std::string& group_name, std::string_view count_text, const std::shared_ptr<Client>& client) {
+    if (!message_log) {
+        send_message(client, chat::Op::Error, "Message history is disabled on this server.");
+        return;
+    }
+    std::shared_ptr<Group> group = groups.find(group_name);
+    if (!group) {
+        std::string error_message = "Group " + group_name + " not found.";
+        send_message(client, chat::Op::Error, error_message);
+        return;
+    }
+    {
+        std::shared_lock<std::shared_mutex> lock(group->mutex);
+        if (!group->members.count(client->user_id())) {
+            std::string error_message = "You are not a member of group " + group_name + ".";
+            send_message(client, chat::Op::Error, error_message);
+            return;
+        }
+    }
+    int count = count_text.empty() ? 10 : std::atoi(std::string(count_text).c_str());
+    if (count <= 0) {
+        send_message(client, chat::Op::Error, "Invalid group command.");
+        return;
+    }
+    message_log->request_history(group_name, count,
+        [client](const chat::LogRecord& record) { send_frame(client, record_frame(record, "(history) ")); },
+        [client, group_name](size_t delivered) {
+            std::string info_message = "End of history for group " + group_name + " (" + std::to_string(delivered) + " messages).";
+            send_message(client, chat::Op::Info, info_message);
+        });
+}
+
+// Startup: replays membership changes from the log so groups survive a restart.
+void restore_from_log(const chat::LogRecord& record) {
+    using chat::RecordType;
+    if (record.type != RecordType::GroupCreate && record.type != RecordType::GroupJoin && record.type != RecordType::GroupLeave) {
+        return;
+    }
+    std::shared_ptr<UserRecord> user = intern_user(std::string(record.a));
+    std::shared_ptr<Group> group = find_or_create_group(std::string(record.b));
+    if (record.type == RecordType::GroupLeave) unlink_member(*user, group);
+    else link_member(*user, group);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Cluster. Every node tells the others which users are logged in on it and every membership
+// change, so each node holds the whole group table plus, per group, how many online members
+// each node has. Messages are routed to the node(s) holding their recipients; the receiving node
+// delivers them like local ones. The state is eventually consistent: a message racing a login on
+// another node can miss it, as it could race a disconnect before.
+
+// Moves user's remote presence to new_node (-1: not logged in elsewhere). Caller holds user.mutex.
+void move_presence_locked(UserRecord& user, int new_node) {
+    if (user.remote_node == new_node) return;
+    for (const auto& group : user.groups) {
+        std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+        if (user.remote_node >= 0) --group->node_live[user.remote_node];
+        if (new_node >= 0) ++group->node_live[new_node];
+    }
+    user.remote_node = new_node;
+}
+
+// A peer (re)connected: send it everything it would otherwise have heard about one by one.
+void handle_link_up(int node) {
+    user_ids.for_each([&](const std::string& name, const std::shared_ptr<UserRecord>& user) {
+        std::lock_guard<std::mutex> lock(user->mutex);
+        if (user->session) bus->send(node, chat::BusOp::Presence, {name}, "1");
+        for (const auto& group : user->groups) bus->send(node, chat::BusOp::GroupJoin, {name}, group->name);
+    });
+    std::cout << "Cluster node " << node << " connected" << std::endl;
+}
+
+// A peer went away: nobody is logged in there any more. Group membership is kept.
+void handle_link_down(int node) {
+    user_ids.for_each([&](const std::string&, const std::shared_ptr<UserRecord>& user) {
+        std::lock_guard<std::mutex> lock(user->mutex);
+        if (user->remote_node == node) move_presence_locked(*user, -1);
+    });
+    std::cout << "Cluster node " << node << " disconnected" << std::endl;
+}
+
+void handle_bus_message(int node, chat::BusOp op, std::string_view payload) {
+    local_metrics().bus_messages_in.add();
+    std::string_view name, target;
+    if (!chat::read_field(payload, name)) return;
+
+    switch (op) {
+    case chat::BusOp::Presence: {
+        std::shared_ptr<UserRecord> user = intern_user(std::string(name));
+        std::lock_guard<std::mutex> lock(user->mutex);
+        if (payload == "1") move_presence_locked(*user, node);
+        else if (user->remote_node == node) move_presence_locked(*user, -1);
+        if (payload == "1" && message_log) {
+            // Private messages stored here while they were offline follow them to their node.
+            message_log->request_missed(user->name, {}, message_log->next_seq(), [node](const chat::LogRecord& record) {
+                bus->send(node, chat::BusOp::PrivateMsg, {record.a, record.b}, record.c);
+            });
+        }
+        break;
+    }
+    case chat::BusOp::GroupCreate:
+    case chat::BusOp::GroupJoin:
+    case chat::BusOp::GroupLeave: {
+        std::string group_name(payload);
+        std::shared_ptr<UserRecord> user = intern_user(std::string(name));
+        std::shared_ptr<Group> group = op == chat::BusOp::GroupLeave ? groups.find(group_name) : find_or_create_group(group_name);
+        if (!group) break;
+        std::lock_guard<std::mutex> lock(user->mutex);
+        std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+        bool changed = op == chat::BusOp::GroupLeave ? unlink_member(*user, group) : link_member(*user, group);
+        if (changed && message_log) {
+            auto type = op == chat::BusOp::GroupLeave ? chat::RecordType::GroupLeave : chat::RecordType::GroupJoin;
+            message_log->append(type, user->name, group_name);
+        }
+        break;
+    }
+    case chat::BusOp::PrivateMsg:
+        if (chat::read_field(payload, target)) deliver_private(name, std::string(target), payload);
+        break;
+    case chat::BusOp::GroupMsg:
+        if (!chat::read_field(payload, target)) break;
+        if (std::shared_ptr<Group> group = groups.find(std::string(target))) {
+            std::shared_lock<std::shared_mutex> lock(group->mutex);
+            deliver_group_locked(*group, name, payload);
+        }
+        break;
+    case chat::BusOp::Broadcast:
+        deliver_broadcast(name, payload, nullptr);
+        break;
+    default:
+        break;
+    }
+}
+
+// We will use following function to handle one command from an authenticated client
+
+CommandType command_type(chat::Op op) {
+    switch (op) {
+    case chat::Op::Broadcast: return CmdBroadcast;
+    case chat::Op::PrivateMsg: return CmdPrivate;
+    case chat::Op::GroupCreate: return CmdGroupCreate;
+    case chat::Op::GroupJoin: return CmdGroupJoin;
+    case chat::Op::GroupLeave: return CmdGroupLeave;
+    case chat::Op::GroupMsg: return CmdGroupMsg;
+    case chat::Op::GroupHistory: return CmdGroupHistory;
+    default: return CmdInvalid;
+    }
+}
+
+// Returns false if the command must be dropped. The client is told once per throttled streak,
+// and a client that keeps sending through a long streak is disconnected.
+bool allow_command(const std::shared_ptr<Client>& client, CommandType type) {
+    uint64_t now = now_ns();
+    bool allowed = client->limits[type].take(command_limits[type], now);
+    if (allowed) {
+        UserRecord& user = *client->user;
+        std::lock_guard<std::mutex> lock(user.limit_mutex);
+        allowed = user.bucket.take(user_limit, now);
+    }
+    if (allowed) {
+        client->throttled_streak = 0;
+        return true;
+    }
+
+    Metrics& metrics = local_metrics();
+    metrics.throttled[type].add();
+    if (++client->throttled_streak == 1) {
+        send_message(client, chat::Op::Error, "Rate limit exceeded; messages are being dropped.");
+    } else if (limit_disconnect_after && client->throttled_streak >= limit_disconnect_after) {
+        metrics.rate_limit_disconnects.add();
+        send_message(client, chat::Op::Error, "Disconnected: rate limit exceeded.");
+        client->state = Client::State::Rejected;
+        close_after_flush(client);
+    }
+    return false;
+}
+
+void handle_command(const std::shared_ptr<Client>& client, const chat::Frame& frame) {
+    std::string_view payload = frame.payload;
+    std::string_view name;
+    CommandType type = command_type(frame.op);
+    local_metrics().commands[type].add();
+    if (!allow_command(client, type)) return;
+
+    switch (frame.op) {
+    case chat::Op::Broadcast:
+        broadcast_message(payload, client);
+        break;
+    case chat::Op::PrivateMsg:
+        if (!chat::read_field(payload, name)) {
+            send_message(client, chat::Op::Error, "Invalid command.");
+            break;
+        }
+        send_private_message(std::string(name), payload, client);
+        break;
+    case chat::Op::GroupCreate:
+        create_group(std::string(payload), client);
+        break;
+    case chat::Op::GroupJoin:
+        join_group(std::string(payload), client);
+        break;
+    case chat::Op::GroupLeave:
+        leave_group(std::string(payload), client);
+        break;
+    case chat::Op::GroupMsg:
+        if (!chat::read_field(payload, name)) {
+            send_message(client, chat::Op::Error, "Invalid command.");
+            break;
+        }
+        send_group_message(std::string(name), payload, client);
+        break;
+    case chat::Op::GroupHistory:
+        if (!chat::read_field(payload, name)) {
+            send_message(client, chat::Op::Error, "Invalid command.");
+            break;
+        }
+        send_group_history(std::string(name), payload, client);
+        break;
+    default:
+        send_message(client, chat::Op::Error, "Invalid command.");
+        break;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Stats endpoint: a Unix stream socket that answers every connection with a Prometheus-style text
+// snapshot and closes it, e.g. `socat - UNIX-CONNECT:/tmp/server_grp.stats`. Aggregation happens
+// here, on the stats thread, so scraping costs the reactors nothing but a few shared locks.
+
+struct HistogramTotals {
+    uint64_t counts[Histogram::BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    void add(const Histogram& h) {
+        for (int i = 0; i < Histogram::BUCKETS; ++i) {
+            uint64_t c = h.counts[i].get();
+            counts[i] += c;
+            count += c;
+        }
+        sum += h.sum.get();
+    }
+
+    uint64_t quantile(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < Histogram::BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return Histogram::upper_bound_of(i);
+        }
+        return Histogram::upper_bound_of(Histogram::BUCKETS - 1);
+    }
+};
+
+const uint64_t server_start_ns = now_ns();
+
+std::string render_metrics() {
+    uint64_t accepted = 0, closed = 0, logins = 0, logouts = 0, auth_failures = 0, auth_busy = 0;
+    uint64_t reloads = 0, reload_failures = 0;
+    uint64_t bytes_in = 0, bytes_out = 0, frames_out = 0, dropped = 0, disconnected = 0, coalesced = 0;
+    uint64_t commands[CMD_TYPES] = {}, throttled[CMD_TYPES] = {};
+    uint64_t rate_limit_disconnects = 0, frames_compressed = 0, compression_saved = 0;
+    HistogramTotals fanout, queue_depth, send_latency, auth_wait, auth_verify;
+    {
+        std::lock_guard<std::mutex> lock(metrics_registry_mutex);
+        for (const Metrics* m : metrics_registry) {
+            accepted += m->connections_accepted.get();
+            closed += m->connections_closed.get();
+            logins += m->logins.get();
+            logouts += m->logouts.get();
+            auth_failures += m->auth_failures.get();
+            auth_busy += m->auth_busy.get();
+            reloads += m->credential_reloads.get();
+            reload_failures += m->credential_reload_failures.get();
+            bytes_in += m->bytes_in.get();
+            bytes_out += m->bytes_out.get();
+            frames_out += m->frames_out.get();
+            dropped += m->slow_consumer_dropped.get();
+            disconnected += m->slow_consumer_disconnected.get();
+            coalesced += m->slow_consumer_coalesced.get();
+            for (int c = 0; c < CMD_TYPES; ++c) commands[c] += m->commands[c].get();
+            for (int c = 0; c < CMD_TYPES; ++c) throttled[c] += m->throttled[c].get();
+            rate_limit_disconnects += m->rate_limit_disconnects.get();
+            frames_compressed += m->frames_compressed.get();
+            compression_saved += m->compression_saved_bytes.get();
+            fanout.add(m->fanout);
+            queue_depth.add(m->queue_depth_bytes);
+            send_latency.add(m->send_latency_ns);
+            auth_wait.add(m->auth_wait_ns);
+            auth_verify.add(m->auth_verify_ns);
+        }
+    }
+
+    // Current queue depths, straight from the live sessions.
+    uint64_t queued_bytes = 0, max_queued_bytes = 0, queued_frames = 0;
+    sessions.for_each([&](const std::string&, const std::shared_ptr<Client>& client) {
+        std::lock_guard<std::mutex> lock(client->out_mutex);
+        queued_bytes += client->out_bytes;
+        queued_frames += client->out_queue.size();
+        max_queued_bytes = std::max<uint64_t>(max_queued_bytes, client->out_bytes);
+    });
+
+    // Per-second command rates relative to the previous scrape (only the stats thread gets here).
+    static uint64_t previous_commands[CMD_TYPES] = {};
+    static uint64_t previous_ns = server_start_ns;
+    uint64_t now = now_ns();
+    double interval = std::max(1e-9, (now - previous_ns) / 1e9);
+
+    std::ostringstream out;
+    out << "chat_uptime_seconds " << (now - server_start_ns) / 1e9 << "\n"
+        << "chat_connections_accepted_total " << accepted << "\n"
+        << "chat_connections_open " << accepted - closed << "\n"
+        << "chat_sessions_active " << logins - logouts << "\n"
+        << "chat_auth_failures_total " << auth_failures << "\n"
+        << "chat_auth_busy_total " << auth_busy << "\n"
+        << "chat_credential_users " << credentials.load()->size() << "\n"
+        << "chat_credential_reloads_total " << reloads << "\n"
+        << "chat_credential_reload_failures_total " << reload_failures << "\n"
+        << "chat_bytes_in_total " << bytes_in << "\n"
+        << "chat_bytes_out_total " << bytes_out << "\n"
+        << "chat_frames_out_total " << frames_out << "\n"
+        << "chat_slow_consumer_total{action=\"dropped\"} " << dropped << "\n"
+        << "chat_slow_consumer_total{action=\"disconnected\"} " << disconnected << "\n"
+        << "chat_slow_consumer_total{action=\"coalesced\"} " << coalesced << "\n"
+        << "chat_outbound_queued_bytes " << queued_bytes << "\n"
+        << "chat_outbound_queued_frames " << queued_frames << "\n"
+        << "chat_outbound_queued_bytes_max " << max_queued_bytes << "\n";
+    for (int c = 0; c < CMD_TYPES; ++c) {
+        out << "chat_commands_total{type=\"" << command_names[c] << "\"} " << commands[c] << "\n";
+    }
+    for (int c = 0; c < CMD_TYPES; ++c) {
+        out << "chat_commands_per_second{type=\"" << command_names[c] << "\"} "
+            << (commands[c] - previous_commands[c]) / interval << "\n";
+        previous_commands[c] = commands[c];
+    }
+    previous_ns = now;
+    for (int c = 0; c < CMD_TYPES; ++c) {
+        out << "chat_commands_throttled_total{type=\"" << command_names[c] << "\"} " << throttled[c] << "\n";
+    }
+    out << "chat_rate_limit_disconnects_total " << rate_limit_disconnects << "\n"
+        << "chat_frames_compressed_total " << frames_compressed << "\n"
+        << "chat_compression_saved_bytes_total " << compression_saved << "\n";
+
+    auto summary = [&](const char* name, const HistogramTotals& h) {
+        for (double q : {0.5, 0.9, 0.99, 0.999}) {
+            out << name << "{quantile=\"" << q << "\"} " << h.quantile(q) << "\n";
+        }
+        out << name << "_sum " << h.sum << "\n" << name << "_count " << h.count << "\n";
+    };
+    summary("chat_fanout_recipients", fanout);
+    summary("chat_outbound_queue_depth_bytes", queue_depth);
+    summary("chat_send_latency_ns", send_latency);
+    summary("chat_auth_wait_ns", auth_wait);
+    summary("chat_auth_verify_ns", auth_verify);
+    return out.str();
+}
+
+void run_stats_endpoint(int listen_fd) {
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("stats accept");
+            return;
+        }
+        std::string text = render_metrics();
+        size_t sent = 0;
+        while (sent < text.size()) {
+            ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(fd);
+    }
+}
+
+int create_stats_socket(const std::string& path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Stats socket path too long: " << path << std::endl;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+        perror("stats socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void close_client(Reactor& reactor, const std::shared_ptr<Client>& client) {
+    Metrics& metrics = local_metrics();
+    metrics.connections_closed.add();
+    if (client->state == Client::State::Authenticated) {
+        metrics.logouts.add();
+        // A newer login may have replaced us; then the user never went offline.
+        if (sessions.erase_if_equal(client->user->name, client)) {
+            if (message_log) message_log->append(chat::RecordType::Logout, client->user->name);
+            if (bus) bus->send_all(chat::BusOp::Presence, {client->user->name}, "0");
+        }
+        detach_session(client);
+    }
+    {
+        // Once closed is set nobody else will queue for or write to the fd, so it is safe to release it.
+        std::lock_guard<std::mutex> lock(client->out_mutex);
+        client->closed = true;
+        client->out_queue.clear();
+        client->out_bytes = 0;
+        epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, client->socket, nullptr);
+        close(client->socket);
+    }
+    reactor.connections.erase(client->socket);
+}
+
+// Allowed at any point of a connection; the reply lists what the server switched on.
+void negotiate_capabilities(const std::shared_ptr<Client>& client, std::string_view features) {
+    std::string enabled;
+    while (!features.empty()) {
+        size_t comma = features.find(',');
+        std::string_view feature = features.substr(0, comma);
+        features.remove_prefix(comma == std::string_view::npos ? features.size() : comma + 1);
+        if (feature == chat::COMPRESSION_FEATURE && config.compression) {
+            client->compress.store(true, std::memory_order_relaxed);
+            enabled = feature;
+        }
+    }
+    send_message(client, chat::Op::CapabilitiesAck, enabled);
+}
+
+// Dispatches every complete frame in the client's ring buffer, stopping early while a login is
+// being verified.
+void dispatch_frames(const std::shared_ptr<Client>& client) {
+    if (client->state == Client::State::Rejected) {
+        client->inbound.consume(client->inbound.size());  // just draining until the reply is out
+        return;
+    }
+    chat::Frame frame;
+    chat::FrameParser::Result result;
+    auto parsing = [&] { return client->state != Client::State::Verifying && client->state != Client::State::Rejected; };
+    while (parsing() && (result = client->parser.next(frame)) == chat::FrameParser::Result::Frame) {
+        if (frame.op == chat::Op::Capabilities) {
+            negotiate_capabilities(client, frame.payload);
+        } else if (client->state == Client::State::Authenticated) {
+            handle_command(client, frame);
+        } else if (!authenticate_user(client, frame)) {
+            client->state = Client::State::Rejected;
+            close_after_flush(client);
+            return;
+        }
+    }
+    if (parsing() && result == chat::FrameParser::Result::Error) {
+        send_message(client, chat::Op::Error, "Malformed frame.");
+        client->state = Client::State::Rejected;
+        close_after_flush(client);
+    }
+}
+
+// Edge-triggered, so drain the socket until EAGAIN. Bytes go straight into the connection's ring
+// buffer and every complete frame in it is dispatched, however the stream was split or coalesced.
+void handle_readable(Reactor& reactor, const std::shared_ptr<Client>& client) {
+    while (true) {
+        if (client->state == Client::State::Verifying) {
+            // Leave the rest in the kernel while the password is being checked; finish_login
+            // calls us again, since edge-triggered epoll will not report the same bytes twice.
+            if (client->inbound.size() >= chat::MAX_FRAME_SIZE) return;
+        } else {
+            dispatch_frames(client);
+        }
+        client->inbound.reserve_free(1);
+        iovec iov[2];
+        int iov_count = client->inbound.writable_regions(iov);
+        ssize_t bytes_received = readv(client->socket, iov, iov_count);
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (bytes_received <= 0) {
+            close_client(reactor, client);
+            return;
+        }
+        client->inbound.commit(bytes_received);
+        local_metrics().bytes_in.add(bytes_received);
+    }
+}
+
+// Runs on the owning reactor, either for EPOLLOUT or because another thread queued output.
+void flush_client(Reactor& reactor, const std::shared_ptr<Client>& client, bool writable) {
+    bool close_now;
+    {
+        std::lock_guard<std::mutex> lock(client->out_mutex);
+        if (client->closed) return;
+        client->flush_scheduled = false;
+        if (writable) client->write_blocked = false;
+        bool ok = client->kill || client->write_blocked || flush_locked(*client);
+        close_now = !ok || client->kill || (client->close_when_flushed && client->out_queue.empty());
+    }
+    if (close_now) close_client(reactor, client);
+}
+
+void accept_clients(Reactor& reactor, int listen_fd) {
+    while (true) {
+        sockaddr_in client_address;
+        socklen_t client_len = sizeof(client_address);
+        int client_socket = accept4(listen_fd, (struct sockaddr*)&client_address, &client_len, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+
+        auto client = std::make_shared<Client>(client_socket, &reactor);
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl");
+            close(client_socket);
+            continue;
+        }
+        reactor.connections[client_socket] = client;
+        local_metrics().connections_accepted.add();
+        send_message(client, chat::Op::Prompt, "Enter username: ");
+    }
+}
+
+// Flushes every client that other threads queued output for since the last wake-up.
+void drain_pending(Reactor& reactor) {
+    uint64_t counter;
+    ssize_t ignored = read(reactor.event_fd, &counter, sizeof(counter));
+    (void)ignored;
+
+    std::vector<std::shared_ptr<Client>> pending;
+    std::vector<std::pair<std::shared_ptr<Client>, bool>> logins;
+    {
+        std::lock_guard<std::mutex> lock(reactor.pending_mutex);
+        pending.swap(reactor.pending_flush);
+        logins.swap(reactor.pending_logins);
+    }
+    for (auto& client : pending) {
+        flush_client(reactor, client, false);
+    }
+    for (auto& [client, ok] : logins) {
+        if (client->closed) continue;
+        if (finish_login(client, ok)) {
+            handle_readable(reactor, client);  // frames that arrived during verification, then the socket
+        } else {
+            client->state = Client::State::Rejected;
+            close_after_flush(client);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Shutdown. SIGTERM or SIGINT drains: every reactor stops accepting, tells its clients, and exits
+// once their queues are written (or --drain-timeout passes). A successor process connecting to
+// the hand-off socket instead makes the reactors stop where they are, and the main thread passes
+// the listening sockets, the connections and their unprocessed bytes to it (see handoff.h).
+
+enum class Lifecycle { Running, Draining, HandingOff };
+std::atomic<Lifecycle> lifecycle{Lifecycle::Running};
+std::atomic<uint64_t> drain_deadline_ns{0};
+
+void stop_accepting(Reactor& reactor, bool close_sockets) {
+    for (int fd : reactor.listen_fds) {
+        epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        if (close_sockets) close(fd);
+    }
+    if (close_sockets) reactor.listen_fds.clear();
+}
+
+void begin_drain(Reactor& reactor) {
+    reactor.draining = true;
+    stop_accepting(reactor, true);
+    std::vector<std::shared_ptr<Client>> clients;
+    for (const auto& [fd, client] : reactor.connections) clients.push_back(client);
+    for (const auto& client : clients) {
+        send_message(client, chat::Op::Info, "Server is shutting down.");
+        close_after_flush(client);
+    }
+}
+
+// Returns false once the reactor should exit.
+bool check_lifecycle(Reactor& reactor) {
+    Lifecycle stage = lifecycle.load();
+    if (stage == Lifecycle::HandingOff) {
+        stop_accepting(reactor, false);  // the sockets themselves go to the successor
+        return false;
+    }
+    if (stage == Lifecycle::Draining) {
+        if (!reactor.draining) begin_drain(reactor);
+        if (now_ns() >= drain_deadline_ns.load()) {
+            std::vector<std::shared_ptr<Client>> clients;
+            for (const auto& [fd, client] : reactor.connections) clients.push_back(client);
+            for (const auto& client : clients) close_client(reactor, client);
+        }
+        return !reactor.connections.empty();
+    }
+    return true;
+}
+
+void run_reactor(Reactor& reactor) {
+    epoll_event events[MAX_EVENTS];
+    while (check_lifecycle(reactor)) {
+        int n = epoll_wait(reactor.epoll_fd, events, MAX_EVENTS, reactor.draining ? 100 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (std::find(reactor.listen_fds.begin(), reactor.listen_fds.end(), fd) != reactor.listen_fds.end()) {
+                accept_clients(reactor, fd);
+                continue;
+            }
+            if (fd == reactor.event_fd) {
+                drain_pending(reactor);
+                continue;
+            }
+            auto it = reactor.connections.find(fd);
+            if (it == reactor.connections.end()) continue;
+            std::shared_ptr<Client> client = it->second;
+
+            if (events[i].events & EPOLLOUT) flush_client(reactor, client, true);
+            if (client->closed) continue;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) handle_readable(reactor, client);
+        }
+    }
+}
+
+int create_listen_socket() {
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server_socket == -1) {
+        std::cerr << "Failed to create socket" << std::endl;
+        return -1;
+    }
+
+    // Every reactor binds its own socket to the same port; the kernel spreads new connections across them.
+    int one = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    sockaddr_in server_address{};
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = INADDR_ANY;
+    server_address.sin_port = htons(config.port);
+
+    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
+        std::cerr << "Bind failed" << std::endl;
+        close(server_socket);
+        return -1;
+    }
+
+    listen(server_socket, SOMAXCONN);
+    return server_socket;
+}
+
+// 50k idle clients need 50k descriptors; the default soft limit is usually 1024.
+void raise_fd_limit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void pin_to_core(std::thread& thread, int core) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+// Listening end of the hand-off channel. Only processes of the same user may connect, since
+// whoever does gets every client socket.
+int create_handoff_socket(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || path.size() >= sizeof(address.sun_path)) return -1;
+    std::strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || chmod(path.c_str(), 0600) < 0 || listen(fd, 1) < 0) {
+        perror("hand-off socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Old process: stop the reactors, then send everything to the successor on peer and exit.
+// Connections still logging in (password being checked) are dropped; their clients reconnect.
+[[noreturn]] void hand_off_sessions(int peer, std::vector<std::unique_ptr<Reactor>>& reactors, std::vector<std::thread>& threads) {
+    lifecycle = Lifecycle::HandingOff;
+    for (auto& reactor : reactors) {
+        uint64_t one = 1;
+        ssize_t ignored = write(reactor->event_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+    for (auto& thread : threads) thread.join();
+    // The successor replays the log directory, so everything appended so far must be on disk.
+    if (message_log) message_log->stop();
+
+    chat::HandoffChannel channel(peer);
+    bool ok = true;
+    for (auto& reactor : reactors) {
+        for (int fd : reactor->listen_fds) ok = ok && channel.add(chat::HandoffOp::Listener, {}, fd);
+    }
+    // Group state, including members on other nodes that the log does not know about.
+    groups.for_each([&](const std::string& name, const std::shared_ptr<Group>&) {
+        ok = ok && channel.add(chat::HandoffOp::Group, name);
+    });
+    user_ids.for_each([&](const std::string& name, const std::shared_ptr<UserRecord>& user) {
+        std::lock_guard<std::mutex> lock(user->mutex);
+        for (const auto& group : user->groups) {
+            std::string payload;
+            chat::append_field(payload, name);
+            payload += group->name;
+            ok = ok && channel.add(chat::HandoffOp::Member, payload);
+        }
+    });
+
+    // Client: u8 state | u8 compress | field(name) | field(unparsed input) | unwritten output
+    size_t handed = 0;
+    std::string payload, scratch;
+    for (auto& reactor : reactors) {
+        for (auto& [fd, client] : reactor->connections) {
+            std::lock_guard<std::mutex> lock(client->out_mutex);
+            client->closed = true;  // senders on other threads drop anything from now on
+            Client::State state = client->state;
+            if (state == Client::State::Verifying || state == Client::State::Rejected) continue;
+            payload.clear();
+            payload.push_back(static_cast<char>(state));
+            payload.push_back(client->compress.load() ? 1 : 0);
+            chat::append_field(payload, state == Client::State::Authenticated ? client->user->name : client->pending_username);
+            chat::append_field(payload, client->inbound.view(0, client->inbound.size(), scratch));
+            size_t skip = client->out_offset;
+            for (const QueuedFrame& queued : client->out_queue) {
+                payload.append(*queued.bytes, skip);
+                skip = 0;
+            }
+            ok = ok && channel.add(chat::HandoffOp::Client, payload, client->socket);
+            ++handed;
+        }
+    }
+    ok = ok && channel.add(chat::HandoffOp::Done, {}) && channel.flush();
+
+    // Wait for the successor to confirm before the descriptors are closed on this side.
+    char ack = 0;
+    ok = ok && read(peer, &ack, 1) == 1;
+    if (!ok) {
+        std::cerr << "Hand-off failed; connections were dropped" << std::endl;
+        std::_Exit(1);
+    }
+    std::cout << "Handed " << handed << " connection(s) to the new process" << std::endl;
+    std::_Exit(0);
+}
+
+// A connection received from the old process, waiting for a reactor.
+struct HandedClient {
+    int fd;
+    Client::State state;
+    bool compress;
+    std::string name;
+    std::string inbound;
+    std::string outbound;
+};
+
+// New process: fetch everything from the server listening on config.takeover. Group state is
+// applied right away; sockets are returned for the reactors. Returns false if nothing usable came.
+bool take_over_sessions(std::vector<int>& listeners, std::vector<HandedClient>& clients) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::snprintf(address.sun_path, sizeof(address.sun_path), "%s", config.takeover.c_str());
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        perror(("take over from " + config.takeover).c_str());
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    chat::HandoffChannel channel(fd);
+    chat::HandoffOp op;
+    std::string_view payload;
+    int received;
+    while (channel.next(op, payload, received)) {
+        if (op == chat::HandoffOp::Done) {
+            ssize_t ignored = write(fd, "1", 1);
+            (void)ignored;
+            std::cout << "Took over " << listeners.size() << " listening socket(s) and " << clients.size()
+                      << " connection(s) from " << config.takeover << std::endl;
+            return true;
+        }
+        if (op == chat::HandoffOp::Listener && received >= 0) {
+            listeners.push_back(received);
+        } else if (op == chat::HandoffOp::Group) {
+            find_or_create_group(std::string(payload));
+        } else if (op == chat::HandoffOp::Member) {
+            std::string_view name;
+            if (!chat::read_field(payload, name)) continue;
+            std::shared_ptr<UserRecord> user = intern_user(std::string(name));
+            std::shared_ptr<Group> group = find_or_create_group(std::string(payload));
+            std::lock_guard<std::mutex> lock(user->mutex);
+            std::unique_lock<std::shared_mutex> group_lock(group->mutex);
+            link_member(*user, group);
+        } else if (op == chat::HandoffOp::Client && received >= 0 && payload.size() >= 2) {
+            HandedClient client{received, static_cast<Client::State>(payload[0]), payload[1] != 0, {}, {}, {}};
+            payload.remove_prefix(2);
+            std::string_view name, inbound;
+            if (!chat::read_field(payload, name) || !chat::read_field(payload, inbound)) {
+                close(received);
+                continue;
+            }
+            client.name = name;
+            client.inbound = inbound;
+            client.outbound = payload;
+            clients.push_back(std::move(client));
+        } else if (received >= 0) {
+            close(received);
+        }
+    }
+    std::cerr << "Hand-off from " << config.takeover << " was cut short" << std::endl;
+    for (int listener : listeners) close(listener);
+    for (auto& client : clients) close(client.fd);
+    listeners.clear();
+    clients.clear();
+    return false;
+}
+
+// Registers a handed-over connection with reactor, as it was in the old process. Runs before
+// the reactor threads start.
+void adopt_client(Reactor& reactor, HandedClient& handed) {
+    auto client = std::make_shared<Client>(handed.fd, &reactor);
+    client->state = handed.state;
+    client->compress = handed.compress;
+    client->pending_username = handed.name;
+    if (client->state == Client::State::Authenticated) {
+        client->user = intern_user(handed.name);
+        sessions.assign(handed.name, client);
+        attach_session(client);
+        if (bus) bus->send_all(chat::BusOp::Presence, {handed.name}, "1");
+    }
+    if (!handed.inbound.empty()) {
+        client->inbound.reserve_free(handed.inbound.size());
+        iovec iov[2];
+        int count = client->inbound.writable_regions(iov);
+        size_t first = std::min(handed.inbound.size(), iov[0].iov_len);
+        std::memcpy(iov[0].iov_base, handed.inbound.data(), first);
+        if (count > 1) std::memcpy(iov[1].iov_base, handed.inbound.data() + first, handed.inbound.size() - first);
+        client->inbound.commit(handed.inbound.size());
+    }
+    if (!handed.outbound.empty()) {
+        // Already encoded for this client (compressed or not), so it goes out exactly as is.
+        auto rest = std::make_shared<const EncodedFrame>(std::move(handed.outbound), now_ns());
+        client->out_bytes = rest->bytes.size();
+        client->out_queue.push_back({rest, &rest->bytes});
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = handed.fd;
+    epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, handed.fd, &ev);
+    reactor.connections[handed.fd] = client;
+    local_metrics().connections_accepted.add();
+    // Commands that were read but not yet processed by the old process.
+    dispatch_frames(client);
+}
+
+// Main thread after startup: waits for SIGTERM/SIGINT (drain) or a successor (hand-off).
+void run_lifecycle(std::vector<std::unique_ptr<Reactor>>& reactors, std::vector<std::thread>& threads) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    int handoff_fd = config.handoff_socket.empty() ? -1 : create_handoff_socket(config.handoff_socket);
+
+    while (true) {
+        pollfd fds[2] = {{signal_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}};
+        if (poll(fds, handoff_fd >= 0 ? 2 : 1, -1) < 0) continue;
+        if (fds[0].revents & POLLIN) break;
+        if (handoff_fd >= 0 && (fds[1].revents & POLLIN)) {
+            int peer = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (peer < 0) continue;
+            ucred credentials_of_peer;
+            socklen_t length = sizeof(credentials_of_peer);
+            if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &credentials_of_peer, &length) < 0 ||
+                credentials_of_peer.uid != getuid()) {
+                close(peer);
+                continue;
+            }
+            std::cout << "Handing off to a new process" << std::endl;
+            hand_off_sessions(peer, reactors, threads);
+        }
+    }
+
+    std::cout << "Draining connections" << std::endl;
+    drain_deadline_ns = now_ns() + static_cast<uint64_t>(config.drain_timeout * 1e9);
+    lifecycle = Lifecycle::Draining;
+    for (auto& reactor : reactors) {
+        uint64_t one = 1;
+        ssize_t ignored = write(reactor->event_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+    for (auto& thread : threads) thread.join();
+    if (message_log) message_log->stop();
+    if (!config.handoff_socket.empty()) unlink(config.handoff_socket.c_str());
+    std::cout << "Drained, exiting" << std::endl;
+    // Helper threads (auth pool, bus, stats) are still parked; skip the static destructors under them.
+    std::_Exit(0);
+}
+
+bool parse_args(int argc, char* argv[]) {
+    bool stats_socket_given = false, log_dir_given = false, handoff_socket_given = false;
+    config.reactor_count = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--threads") {
+            config.reactor_count = std::max(1, std::atoi(value.c_str()));
+        } else if (arg == "--users") {
+            config.users_file = value;
+        } else if (arg == "--stats-socket") {
+            config.stats_socket = value;
+            stats_socket_given = true;
+        } else if (arg == "--max-queue-bytes") {
+            config.max_queue_bytes = std::max(1024UL, std::strtoul(value.c_str(), nullptr, 10));
+        } else if (arg == "--auth-threads") {
+            config.auth_threads = std::max(1, std::atoi(value.c_str()));
+        } else if (arg == "--auth-queue") {
+            config.auth_queue = std::max(1UL, std::strtoul(value.c_str(), nullptr, 10));
+        } else if (arg == "--build-index") {
+            config.build_index = value;
+        } else if (arg == "--kdf-iterations") {
+            config.kdf_iterations = std::max(1UL, std::strtoul(value.c_str(), nullptr, 10));
+        } else if (arg == "--log-dir") {
+            config.log_dir = value;
+            log_dir_given = true;
+        } else if (arg == "--limit") {
+            // TYPE=RATE:BURST, TYPE being a command name from the metrics or "user"
+            size_t eq = value.find('='), colon = value.find(':');
+            if (eq == std::string::npos || colon == std::string::npos || colon < eq) return false;
+            std::string type = value.substr(0, eq);
+            RateLimit limit{std::atof(value.substr(eq + 1, colon - eq - 1).c_str()), std::atof(value.substr(colon + 1).c_str())};
+            if (type == "user") {
+                user_limit = limit;
+            } else {
+                auto it = std::find(std::begin(command_names), std::end(command_names), type);
+                if (it == std::end(command_names)) return false;
+                command_limits[it - std::begin(command_names)] = limit;
+            }
+        } else if (arg == "--limit-disconnect") {
+            limit_disconnect_after = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--compression") {
+            if (value == "on") config.compression = true;
+            else if (value == "off") config.compression = false;
+            else return false;
+        } else if (arg == "--compress-min") {
+            config.compress_min_bytes = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--drain-timeout") {
+            config.drain_timeout = std::max(0.0, std::atof(value.c_str()));
+        } else if (arg == "--handoff-socket") {
+            config.handoff_socket = value;
+            handoff_socket_given = true;
+        } else if (arg == "--takeover") {
+            config.takeover = value;
+        } else if (arg == "--port") {
+            config.port = std::atoi(value.c_str());
+        } else if (arg == "--node-id") {
+            config.node_id = std::max(0, std::atoi(value.c_str()));
+        } else if (arg == "--nodes") {
+            config.node_count = std::max(1, std::atoi(value.c_str()));
+        } else if (arg == "--cluster-dir") {
+            config.cluster_dir = value;
+        } else if (arg == "--slow-consumer") {
+            if (value == "drop") config.slow_consumer = SlowConsumerPolicy::Drop;
+            else if (value == "disconnect") config.slow_consumer = SlowConsumerPolicy::Disconnect;
+            else if (value == "coalesce") config.slow_consumer = SlowConsumerPolicy::Coalesce;
+            else return false;
+        } else {
+            return false;
+        }
+    }
+    if (config.node_id >= config.node_count) return false;
+    if (config.port == 0) config.port = PORT + config.node_id;
+    // Nodes sharing a host must not share the default stats socket, log directory or hand-off socket.
+    if (config.node_count > 1) {
+        std::string suffix = "." + std::to_string(config.node_id);
+        if (!stats_socket_given && !config.stats_socket.empty()) config.stats_socket += suffix;
+        if (!log_dir_given && !config.log_dir.empty()) config.log_dir += suffix;
+        if (!handoff_socket_given && !config.handoff_socket.empty()) config.handoff_socket += suffix;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    // WSADATA wsaData;
+    // WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--threads N] [--users FILE] [--stats-socket PATH] [--max-queue-bytes N] [--slow-consumer drop|disconnect|coalesce] [--log-dir DIR] [--auth-threads N] [--auth-queue N]" << std::endl;
+        std::cerr << "       [--port N] [--nodes N --node-id K] [--cluster-dir DIR] [--limit TYPE=RATE:BURST]... [--limit-disconnect N]" << std::endl;
+        std::cerr << "       [--compression on|off] [--compress-min BYTES] [--drain-timeout SECS] [--handoff-socket PATH] [--takeover PATH]" << std::endl;
+        std::cerr << "       " << argv[0] << " --users FILE --build-index OUT [--kdf-iterations N]" << std::endl;
+        return 1;
+    }
+    int reactor_count = config.reactor_count;
+    if (!config.build_index.empty()) {
+        return build_credential_index() ? 0 : 1;
+    }
+
+    // Block these before any thread starts, so each is only read from its signalfd: SIGHUP by the
+    // credential watcher, SIGTERM and SIGINT by the main thread (run_lifecycle).
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGHUP);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, nullptr);
+
+    if (!load_users()) return 1;
+    std::thread(run_credential_watcher).detach();
+    raise_fd_limit();
+    auth_pool.start(config.auth_threads > 0 ? config.auth_threads : std::max(1, reactor_count / 2), config.auth_queue);
+    // Taking over must finish before the log is opened: the old process flushes it on the way out.
+    std::vector<int> listeners;
+    std::vector<HandedClient> handed;
+    if (!config.takeover.empty() && !take_over_sessions(listeners, handed)) {
+        std::cerr << "Starting without the old process's connections" << std::endl;
+    }
+    if (!config.log_dir.empty()) {
+        message_log = std::make_unique<chat::MessageLog>();
+        if (!message_log->open(config.log_dir, restore_from_log)) return 1;
+        message_log->start();
+    }
+    if (config.node_count > 1) {
+        bus = std::make_unique<chat::UnixSocketBus>(config.cluster_dir, config.node_id, config.node_count);
+        if (!bus->start({handle_link_up, handle_link_down, handle_bus_message})) return 1;
+        std::cout << "Cluster node " << config.node_id << " of " << config.node_count << " on " << config.cluster_dir << std::endl;
+    }
+
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    for (int i = 0; i < reactor_count; ++i) {
+        auto reactor = std::make_unique<Reactor>();
+        reactor->id = i;
+        // Inherited listening sockets keep their accept queues; spread them over the reactors.
+        for (size_t k = i; k < listeners.size(); k += reactor_count) reactor->listen_fds.push_back(listeners[k]);
+        if (reactor->listen_fds.empty()) reactor->listen_fds.push_back(create_listen_socket());
+        reactor->epoll_fd = epoll_create1(0);
+        reactor->event_fd = eventfd(0, EFD_NONBLOCK);
+        if (reactor->listen_fds.back() < 0 || reactor->epoll_fd < 0 || reactor->event_fd < 0) {
+            return 1;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        for (int fd : reactor->listen_fds) {
+            ev.data.fd = fd;
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        ev.events = EPOLLIN;
+        ev.data.fd = reactor->event_fd;
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &ev);
+        reactors.push_back(std::move(reactor));
+    }
+
+    for (size_t i = 0; i < handed.size(); ++i) adopt_client(*reactors[i % reactors.size()], handed[i]);
+    handed.clear();
+
+    std::cout << "Server listening on port " << config.port << " with " << reactor_count << " reactor(s)" << std::endl;
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (auto& reactor : reactors) {
+        threads.emplace_back(run_reactor, std::ref(*reactor));
+        pin_to_core(threads.back(), reactor->id % cores);
+    }
+    if (!config.stats_socket.empty()) {
+        int stats_fd = create_stats_socket(config.stats_socket);
+        if (stats_fd >= 0) {
+            std::thread(run_stats_endpoint, stats_fd).detach();
+            std::cout << "Stats available on " << config.stats_socket << std::endl;
+        }
+    }
+
+    run_lifecycle(reactors, threads);
+    // WSACleanup();
+    return 0;
+}
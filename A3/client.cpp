@@ -1,46 +1,17 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <random>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include "checksum.h"
+#include "socket_filter.h"
 
 // This code implements a TCP client that performs a 3-way handshake with a server using raw sockets.
 // It sends a SYN packet, waits for a SYN-ACK response, and then sends an ACK packet to complete the handshake.
-struct pseudo_header {
-    uint32_t source_address;
-    uint32_t dest_address;
-    uint8_t placeholder;
-    uint8_t protocol;
-    uint16_t tcp_length;
-};
-
-// This function makes a checksum for the TCP packet. It takes a pointer to the packet and its length in bytes as arguments.
-// It returns the checksum as an unsigned short integer.
-unsigned short checksum(unsigned short *ptr, int nbytes) {
-    register long sum = 0;
-    unsigned short oddbyte;
-    register short answer;
-
-    while (nbytes > 1) {
-        sum += *ptr++;
-        nbytes -= 2;
-    }
-
-    if (nbytes == 1) {
-        oddbyte = 0;
-        *((unsigned char *)&oddbyte) = *(unsigned char *)ptr;
-        sum += oddbyte;
-    }
-
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    answer = (short)~sum;
-
-    return answer;
-}
 // This function sends a TCP packet. It takes the socket file descriptor, source and destination IP addresses, source and destination ports,
 // sequence and acknowledgment numbers, and SYN and ACK flags as arguments. It constructs the TCP packet and sends it to the destination.
 void send_tcp_packet(int sock, const char *src_ip, const char *dst_ip, uint16_t src_port, uint16_t dst_port,
@@ -77,21 +48,9 @@ void send_tcp_packet(int sock, const char *src_ip, const char *dst_ip, uint16_t
     tcp->check = 0;
     tcp->urg_ptr = 0;
 
-    // This is the pseudo header for TCP checksum calculation
-    // The pseudo header is used to calculate the checksum for TCP packets.
-    struct pseudo_header psh;
-    psh.source_address = inet_addr(src_ip);
-    psh.dest_address = inet_addr(dst_ip);
-    psh.placeholder = 0;
-    psh.protocol = IPPROTO_TCP;
-    psh.tcp_length = htons(sizeof(struct tcphdr));
-    // The pseudo header is used to calculate the checksum for TCP packets.
-    // The checksum is calculated using the pseudo header and the TCP header.
-    char pseudo_packet[sizeof(struct pseudo_header) + sizeof(struct tcphdr)];
-    memcpy(pseudo_packet, &psh, sizeof(struct pseudo_header));
-    memcpy(pseudo_packet + sizeof(struct pseudo_header), tcp, sizeof(struct tcphdr));
-    // The checksum is calculated using the pseudo header and the TCP header.
-    tcp->check = checksum((unsigned short *)pseudo_packet, sizeof(pseudo_packet));
+    // The checksum covers the TCP header plus a pseudo header of the IP addresses, protocol and
+    // length; tcp_checksum() adds those straight from the IP header instead of copying them.
+    tcp->check = tcp_checksum(ip, tcp, sizeof(struct tcphdr));
     // This is the destination address and port for the packet.
     dest.sin_family = AF_INET;
     dest.sin_port = htons(dst_port);
@@ -104,8 +63,8 @@ void send_tcp_packet(int sock, const char *src_ip, const char *dst_ip, uint16_t
                   << " SYN=" << syn << " ACK flag=" << ack << std::endl;
     }
 }
-// This function performs the TCP 3-way handshake. It creates a raw socket, sends a SYN packet with SEQ=200, waits for a SYN-ACK response,
-// and then sends an ACK packet with SEQ=600 and ACK=401. It uses the send_tcp_packet function to send the packets.
+// This function performs the TCP 3-way handshake. It creates a raw socket, sends a SYN packet with a random SEQ, waits for a SYN-ACK response,
+// and then sends an ACK packet acknowledging the server's SEQ. It uses the send_tcp_packet function to send the packets.
 void client_handshake() {
     int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
     if (sock < 0) {
@@ -124,14 +83,20 @@ void client_handshake() {
     uint16_t src_port = 54321;
     uint16_t dst_port = 12345;
 
+    // Only the server's SYN-ACK to our port gets past the kernel; everything else on the host is
+    // dropped before it is copied to us. The checks in the loop below stay as a fallback.
+    TcpMatch match;
+    match.src_port = dst_port;
+    match.dst_port = src_port;
+    match.flags_mask = 0x12;   // SYN | ACK
+    match.flags_value = 0x12;
+    attach_tcp_filter(sock, match);
+
     // This is the initial sequence number for the client. It can be any value, but it should be unique for each connection.
-    uint32_t client_seq = 200; 
-    // I had tried to take a random number for the initial sequence number, but it was not working and due to lack of time, I couldn't debug it and work on it, this was purely experimental
+    // The server no longer insists on 200, so pick a random one as real TCP stacks do.
+    std::random_device random;
+    uint32_t client_seq = random();
 
-//     srand(time(0));  // Seed random number generator
-// uint32_t client_seq = rand() % 100000 + 1000;  // Random initial sequence number
- // Required by server
- 
     send_tcp_packet(sock, src_ip, dst_ip, src_port, dst_port, client_seq, 0, true, false);
 
     // Step 2: Wait for SYN-ACK and parse it
@@ -164,12 +129,12 @@ void client_handshake() {
         }
     }
 
-    // Step 3: Send ACK with SEQ=600, ACK=401
-    uint32_t client_final_seq = 600;  // Client's sequence number
-    uint32_t client_ack_seq = server_seq + 1;  // Server's ACK + 1
+    // Step 3: Send ACK with SEQ=client ISN+1, ACK=server ISN+1
+    uint32_t client_final_seq = client_seq + 1;  // Our SYN used up one sequence number
+    uint32_t client_ack_seq = server_seq + 1;  // Server's ISN + 1
 
     // This is the final ACK packet sent to the server to complete the handshake.
-    // The sequence number is set to 600 and the acknowledgment number is set to server_seq + 1.
+    // The server checks both numbers against the SYN-ACK it sent for this connection.
     send_tcp_packet(sock, src_ip, dst_ip, src_port, dst_port, client_final_seq, client_ack_seq, false, true);
     std::cout << "[+] Final ACK sent. Handshake complete." << std::endl;
 
@@ -0,0 +1,416 @@
+// Connection state for the handshake server, so it can take many handshakes at once instead of one.
+//
+// A half-open connection (SYN received, SYN-ACK sent, final ACK pending) lives in HalfOpenTable, a
+// flat open-addressing table keyed by the 4-tuple with one 32-byte slot per entry, until its ACK
+// arrives or it times out. Initial sequence numbers follow RFC 6528: a 4 microsecond clock plus a
+// keyed hash of the 4-tuple, so every connection gets its own and nobody off-path can guess them.
+// With SYN cookies (RFC 4987) the server keeps no state at all for a connection: what it needs to
+// check the final ACK is encoded in the sequence number of its SYN-ACK.
+
+#ifndef A3_HANDSHAKE_H
+#define A3_HANDSHAKE_H
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <sys/random.h>
+
+inline uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+inline uint64_t rotl64(uint64_t x, int bits) { return (x << bits) | (x >> (64 - bits)); }
+
+// SipHash-2-4: a fast keyed hash, safe to use where whoever sends the packets controls the input.
+// Input words are read little-endian, as on x86 and ARM.
+inline uint64_t siphash24(const uint64_t key[2], const void* data, size_t length) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t v0 = 0x736f6d6570736575ull ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dull ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ull ^ key[0];
+    uint64_t v3 = 0x7465646279746573ull ^ key[1];
+    auto round = [&] {
+        v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+        v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+    };
+    size_t whole = length & ~size_t(7);
+    for (size_t i = 0; i < whole; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        v3 ^= word;
+        round(); round();
+        v0 ^= word;
+    }
+    uint64_t last = static_cast<uint64_t>(length) << 56;
+    for (size_t i = 0; i < (length & 7); ++i) last |= static_cast<uint64_t>(bytes[whole + i]) << (8 * i);
+    v3 ^= last;
+    round(); round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    round(); round(); round(); round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+inline void random_key(uint64_t key[2]) {
+    size_t filled = 0;
+    while (filled < 2 * sizeof(uint64_t)) {
+        ssize_t n = getrandom(reinterpret_cast<char*>(key) + filled, 2 * sizeof(uint64_t) - filled, 0);
+        if (n > 0) filled += n;
+    }
+}
+
+// Addresses and ports in network byte order, exactly as they are on the wire. "Remote" is the
+// peer that sent the SYN.
+struct ConnKey {
+    uint32_t remote_addr;
+    uint32_t local_addr;
+    uint16_t remote_port;
+    uint16_t local_port;
+
+    bool operator==(const ConnKey& other) const {
+        return remote_addr == other.remote_addr && local_addr == other.local_addr &&
+               remote_port == other.remote_port && local_port == other.local_port;
+    }
+};
+static_assert(sizeof(ConnKey) == 12, "ConnKey is hashed as raw bytes");
+
+// Linear probing with backward-shift deletion, so there are no tombstones and lookups never slow
+// down as connections come and go. The table is sized once for the backlog and never grows.
+class HalfOpenTable {
+public:
+    struct Entry {
+        ConnKey key;
+        uint32_t hash;
+        uint32_t iss;         // our initial sequence number
+        uint32_t irs;         // the peer's
+        uint32_t expires_ms;  // on the engine's millisecond clock
+        uint16_t mss;         // the peer's, from its SYN
+        uint8_t used;
+        uint8_t unused;
+    };
+    static_assert(sizeof(Entry) == 32, "two entries per cache line");
+
+    explicit HalfOpenTable(size_t limit) : limit_(limit) {
+        size_t capacity = 16;
+        while (capacity < limit + limit / 2) capacity <<= 1;  // load factor at most 2/3
+        slots_.assign(capacity, Entry{});
+        mask_ = capacity - 1;
+    }
+
+    Entry* find(const ConnKey& key, uint32_t hash) {
+        for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+            Entry& entry = slots_[i];
+            if (!entry.used) return nullptr;
+            if (entry.hash == hash && entry.key == key) return &entry;
+        }
+    }
+
+    // A fresh entry for key, which must not be in the table, or nullptr once the backlog is full.
+    Entry* insert(const ConnKey& key, uint32_t hash) {
+        if (size_ >= limit_) return nullptr;
+        size_t i = hash & mask_;
+        while (slots_[i].used) i = (i + 1) & mask_;
+        Entry& entry = slots_[i];
+        entry = Entry{};
+        entry.key = key;
+        entry.hash = hash;
+        entry.used = 1;
+        if (++size_ > peak_) peak_ = size_;
+        return &entry;
+    }
+
+    void erase(Entry* entry) { erase_at(entry - slots_.data()); }
+
+    // Examines up to `slots` slots, continuing from where the last call stopped, and removes the
+    // entries that expired by now_ms. Returns how many were removed.
+    size_t expire(uint32_t now_ms, size_t slots) {
+        size_t removed = 0;
+        while (slots-- > 0 && size_ > 0) {
+            Entry& entry = slots_[hand_];
+            if (entry.used && expired(entry, now_ms)) {
+                // Another entry may shift into this slot, so look at it again.
+                erase_at(hand_);
+                ++removed;
+                continue;
+            }
+            hand_ = (hand_ + 1) & mask_;
+        }
+        return removed;
+    }
+
+    static bool expired(const Entry& entry, uint32_t now_ms) {
+        return static_cast<int32_t>(now_ms - entry.expires_ms) >= 0;
+    }
+
+    size_t size() const { return size_; }
+    size_t peak() const { return peak_; }
+    size_t limit() const { return limit_; }
+    size_t capacity() const { return slots_.size(); }
+    size_t bytes() const { return slots_.size() * sizeof(Entry); }
+
+private:
+    void erase_at(size_t i) {
+        for (size_t j = (i + 1) & mask_; slots_[j].used; j = (j + 1) & mask_) {
+            // The entry at j can fill the hole at i if i lies on its probe path, between its home
+            // slot and j.
+            size_t home = slots_[j].hash & mask_;
+            if (((j - home) & mask_) >= ((j - i) & mask_)) {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i].used = 0;
+        --size_;
+    }
+
+    std::vector<Entry> slots_;
+    size_t mask_ = 0;
+    size_t limit_;
+    size_t size_ = 0;
+    size_t peak_ = 0;
+    size_t hand_ = 0;
+};
+
+enum class CookieMode {
+    Off,     // table only; SYNs beyond the backlog are dropped
+    Auto,    // table first, SYN cookies once the backlog is full
+    Always,  // SYN cookies only, no per-connection state
+};
+
+// The parts of an incoming TCP segment the engine looks at. Sequence numbers in host order.
+struct Segment {
+    ConnKey key;
+    uint32_t seq;
+    uint32_t ack_seq;
+    bool syn;
+    bool ack;
+    bool rst;
+    uint16_t mss;  // from the MSS option of a SYN; 0 if it had none
+};
+
+// What to send, or what was agreed. Sequence numbers in host order.
+struct Reply {
+    uint32_t seq;
+    uint32_t ack_seq;
+    uint16_t mss;
+    bool cookie;  // the connection was (or will be) checked by SYN cookie rather than by the table
+};
+
+class HandshakeEngine {
+public:
+    struct Options {
+        size_t backlog = 4096;  // half-open connections held at once
+        uint32_t timeout_ms = 3000;
+        CookieMode cookies = CookieMode::Auto;
+        uint16_t mss = 1460;  // advertised in our SYN-ACKs
+        // Let a RST drop a half-open connection, as TCP requires. Off by default: on a raw socket the
+        // peer host's own TCP stack resets every SYN-ACK (no socket there owns the port) before the
+        // peer program's ACK arrives, so honoring resets breaks the plain server/client demo.
+        bool accept_resets = false;
+    };
+
+    struct Stats {
+        uint64_t syns = 0;
+        uint64_t syn_retransmits = 0;  // SYNs for a connection already in the table
+        uint64_t cookies_sent = 0;
+        uint64_t established = 0;
+        uint64_t established_by_cookie = 0;
+        uint64_t expired = 0;
+        uint64_t resets = 0;
+        uint64_t backlog_drops = 0;  // SYNs dropped because the table was full and cookies were off
+        uint64_t bad_acks = 0;       // ACKs that matched no connection and no valid cookie
+    };
+
+    enum class Event {
+        Ignored,
+        SendSynAck,   // send a SYN-ACK built from the reply
+        Established,  // the final ACK checked out; the reply holds the connection's parameters
+        Reset,        // the peer aborted a half-open connection
+    };
+
+    explicit HandshakeEngine(const Options& options) : options_(options), table_(options.backlog) {
+        random_key(table_key_);
+        random_key(isn_key_);
+        random_key(cookie_keys_[0]);
+        random_key(cookie_keys_[1]);
+        last_sweep_ms_ = clock_ms(monotonic_ns());
+    }
+
+    Event handle(const Segment& segment, uint64_t now_ns, Reply& reply) {
+        uint32_t now_ms = clock_ms(now_ns);
+        if (segment.rst) return handle_reset(segment);
+        if (segment.syn && !segment.ack) return handle_syn(segment, now_ns, now_ms, reply);
+        if (segment.ack && !segment.syn) return handle_ack(segment, now_ns, now_ms, reply);
+        return Event::Ignored;
+    }
+
+    // Times out half-open connections. Called at least every few hundred milliseconds, it walks the
+    // whole table about four times per timeout, a slice at a time, so a connection is gone at most a
+    // quarter of a timeout after it expired. Lookups treat an expired entry as gone anyway.
+    void expire(uint64_t now_ns) {
+        uint32_t now_ms = clock_ms(now_ns);
+        uint32_t elapsed = now_ms - last_sweep_ms_;
+        uint32_t period = options_.timeout_ms / 4 + 1;
+        if (elapsed == 0) return;
+        size_t slots = elapsed >= period ? table_.capacity() : table_.capacity() * elapsed / period + 1;
+        stats_.expired += table_.expire(now_ms, slots);
+        last_sweep_ms_ = now_ms;
+    }
+
+    const Stats& stats() const { return stats_; }
+    const HalfOpenTable& table() const { return table_; }
+
+private:
+    static constexpr uint16_t MSS_TABLE[] = {536, 1300, 1440, 1460};
+    static constexpr int MSS_TABLE_SIZE = sizeof(MSS_TABLE) / sizeof(MSS_TABLE[0]);
+    static constexpr int COOKIE_BITS = 24;
+    static constexpr uint32_t COOKIE_MASK = (1u << COOKIE_BITS) - 1;
+    static constexpr uint32_t MAX_COOKIE_AGE = 2;  // minutes
+
+    static uint32_t clock_ms(uint64_t now_ns) { return static_cast<uint32_t>(now_ns / 1000000); }
+
+    uint32_t table_hash(const ConnKey& key) const {
+        return static_cast<uint32_t>(siphash24(table_key_, &key, sizeof(key)));
+    }
+
+    // RFC 6528: ISN = M + F(4-tuple, secret), M a clock ticking every 4 microseconds.
+    uint32_t initial_sequence(const ConnKey& key, uint64_t now_ns) const {
+        return static_cast<uint32_t>(now_ns / 4000) + static_cast<uint32_t>(siphash24(isn_key_, &key, sizeof(key)));
+    }
+
+    // The largest entry of MSS_TABLE the peer can take; a SYN without the option means 536.
+    static int mss_index(uint16_t mss) {
+        int index = 0;
+        while (index + 1 < MSS_TABLE_SIZE && MSS_TABLE[index + 1] <= mss) ++index;
+        return index;
+    }
+
+    uint32_t cookie_hash(const ConnKey& key, uint32_t count, int which) const {
+        uint8_t input[sizeof(ConnKey) + sizeof(count)];
+        std::memcpy(input, &key, sizeof(key));
+        std::memcpy(input + sizeof(key), &count, sizeof(count));
+        return static_cast<uint32_t>(siphash24(cookie_keys_[which], input, sizeof(input)));
+    }
+
+    // The cookie layout of Linux's syncookies: the top 8 bits carry a minute counter, the low 24 a
+    // MAC over the 4-tuple and that counter plus the MSS index, all offset by the peer's ISN and a
+    // second hash so the value looks as random as an ordinary ISN.
+    uint32_t make_cookie(const ConnKey& key, uint32_t irs, uint32_t count, int mss_index) const {
+        return cookie_hash(key, 0, 0) + irs + (count << COOKIE_BITS) +
+               ((cookie_hash(key, count, 1) + mss_index) & COOKIE_MASK);
+    }
+
+    // The MSS index encoded in cookie, or -1 if it is forged or older than MAX_COOKIE_AGE minutes.
+    int check_cookie(const ConnKey& key, uint32_t cookie, uint32_t irs, uint32_t count) const {
+        cookie -= cookie_hash(key, 0, 0) + irs;
+        uint32_t age = (count - (cookie >> COOKIE_BITS)) & (0xffffffffu >> COOKIE_BITS);
+        if (age >= MAX_COOKIE_AGE) return -1;
+        uint32_t index = (cookie - cookie_hash(key, count - age, 1)) & COOKIE_MASK;
+        return index < static_cast<uint32_t>(MSS_TABLE_SIZE) ? static_cast<int>(index) : -1;
+    }
+
+    static uint32_t cookie_count(uint64_t now_ns) { return static_cast<uint32_t>(now_ns / 60000000000ull); }
+
+    Event handle_syn(const Segment& segment, uint64_t now_ns, uint32_t now_ms, Reply& reply) {
+        ++stats_.syns;
+        reply.ack_seq = segment.seq + 1;
+        reply.mss = options_.mss;
+        reply.cookie = false;
+
+        if (options_.cookies != CookieMode::Always) {
+            uint32_t hash = table_hash(segment.key);
+            HalfOpenTable::Entry* entry = table_.find(segment.key, hash);
+            if (entry && entry->irs == segment.seq && !HalfOpenTable::expired(*entry, now_ms)) {
+                // Our SYN-ACK was lost or is late: answer with the same one.
+                ++stats_.syn_retransmits;
+                reply.seq = entry->iss;
+                return Event::SendSynAck;
+            }
+            // A new SYN on the 4-tuple of a stale half-open connection replaces it.
+            if (!entry) entry = table_.insert(segment.key, hash);
+            if (entry) {
+                entry->iss = initial_sequence(segment.key, now_ns);
+                entry->irs = segment.seq;
+                entry->mss = segment.mss ? segment.mss : MSS_TABLE[0];
+                entry->expires_ms = now_ms + options_.timeout_ms;
+                reply.seq = entry->iss;
+                return Event::SendSynAck;
+            }
+            if (options_.cookies == CookieMode::Off) {
+                ++stats_.backlog_drops;
+                return Event::Ignored;
+            }
+        }
+
+        ++stats_.cookies_sent;
+        reply.seq = make_cookie(segment.key, segment.seq, cookie_count(now_ns), mss_index(segment.mss));
+        reply.cookie = true;
+        return Event::SendSynAck;
+    }
+
+    Event handle_ack(const Segment& segment, uint64_t now_ns, uint32_t now_ms, Reply& reply) {
+        if (options_.cookies != CookieMode::Always) {
+            uint32_t hash = table_hash(segment.key);
+            HalfOpenTable::Entry* entry = table_.find(segment.key, hash);
+            if (entry && HalfOpenTable::expired(*entry, now_ms)) {
+                table_.erase(entry);
+                ++stats_.expired;
+                entry = nullptr;
+            }
+            if (entry) {
+                if (segment.ack_seq != entry->iss + 1 || segment.seq != entry->irs + 1) {
+                    ++stats_.bad_acks;
+                    return Event::Ignored;
+                }
+                reply.seq = entry->iss + 1;
+                reply.ack_seq = entry->irs + 1;
+                reply.mss = entry->mss;
+                reply.cookie = false;
+                table_.erase(entry);
+                ++stats_.established;
+                return Event::Established;
+            }
+        }
+
+        if (options_.cookies != CookieMode::Off) {
+            int index = check_cookie(segment.key, segment.ack_seq - 1, segment.seq - 1, cookie_count(now_ns));
+            if (index >= 0) {
+                reply.seq = segment.ack_seq;
+                reply.ack_seq = segment.seq;
+                reply.mss = MSS_TABLE[index];
+                reply.cookie = true;
+                ++stats_.established;
+                ++stats_.established_by_cookie;
+                return Event::Established;
+            }
+        }
+        ++stats_.bad_acks;
+        return Event::Ignored;
+    }
+
+    Event handle_reset(const Segment& segment) {
+        if (!options_.accept_resets || options_.cookies == CookieMode::Always) return Event::Ignored;
+        HalfOpenTable::Entry* entry = table_.find(segment.key, table_hash(segment.key));
+        // Only a reset carrying exactly the sequence number we expect next (RFC 5961), so that
+        // blind resets cannot tear down connections.
+        if (!entry || segment.seq != entry->irs + 1) return Event::Ignored;
+        table_.erase(entry);
+        ++stats_.resets;
+        return Event::Reset;
+    }
+
+    Options options_;
+    HalfOpenTable table_;
+    Stats stats_;
+    uint64_t table_key_[2];
+    uint64_t isn_key_[2];
+    uint64_t cookie_keys_[2][2];
+    uint32_t last_sweep_ms_ = 0;
+};
+
+#endif
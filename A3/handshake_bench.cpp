@@ -0,0 +1,539 @@
+// Load generator for the handshake server: a SYN storm over loopback, or the replay of a capture.
+//
+// Synthetic mode opens --count connections from varied 4-tuples: source addresses from 127.0.1.1
+// up and ports from 1024 up, at --rate SYNs per second or as fast as possible. Packets are built
+// like client.cpp's send_tcp_packet(). Every SYN-ACK is answered with the final ACK, unless
+// --no-ack makes it a plain SYN flood. Replay mode sends the IPv4 TCP packets of a pcap file
+// instead, at their recorded pace or at --rate. By default they are retargeted to the server and
+// given loopback source addresses. --no-rewrite sends them as captured, so the server's replies go
+// off this host to the addresses in the capture. SYN-ACKs to replayed SYNs are acknowledged the
+// same way, and then only the capture's SYNs are sent. --write saves the SYNs a run sent. At the
+// end it reports SYN-ACKs and completed handshakes per second, the SYN -> SYN-ACK latency
+// distribution, and what went unanswered or was dropped.
+//
+// Run as root next to the server, e.g.
+//   sudo ./server --count 0 --quiet --syncookies always
+//   sudo ./handshake_bench --count 100000 --rate 50000
+// The benchmark machine's kernel answers each SYN-ACK with a RST. The server ignores those unless it
+// runs with --accept-resets (see the Readme).
+
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "handshake.h"
+#include "packet_io.h"
+#include "socket_filter.h"
+
+#define SERVER_PORT 12345
+#define FIRST_SOURCE_PORT 1024
+#define PORTS_PER_ADDRESS (65536 - FIRST_SOURCE_PORT)
+
+struct BenchOptions {
+    int port = SERVER_PORT;
+    uint64_t count = 100000;
+    uint64_t rate = 0;  // packets per second; 0 sends as fast as possible (or at the capture's pace)
+    uint32_t sources = 1;
+    bool ack = true;
+    bool incremental = true;  // patch a template SYN's checksum instead of recomputing it
+    std::string replay;
+    bool rewrite = true;
+    std::string write;
+    uint32_t wait_ms = 1000;
+};
+
+// Builds an IPv4/TCP packet into packet the way client.cpp's send_tcp_packet() does and returns
+// its length. Addresses and ports in network byte order, sequence numbers in host order.
+size_t build_tcp_packet(char *packet, uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport,
+                        uint32_t seq, uint32_t ack_seq, bool syn, bool ack) {
+    const size_t length = sizeof(struct iphdr) + sizeof(struct tcphdr);
+    struct iphdr *ip = (struct iphdr *)packet;
+    struct tcphdr *tcp = (struct tcphdr *)(packet + sizeof(struct iphdr));
+
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tos = 0;
+    ip->tot_len = htons(length);
+    ip->id = htons(54321);
+    ip->frag_off = 0;
+    ip->ttl = 255;
+    ip->protocol = IPPROTO_TCP;
+    ip->check = 0;
+    ip->saddr = saddr;
+    ip->daddr = daddr;
+
+    tcp->source = sport;
+    tcp->dest = dport;
+    tcp->seq = htonl(seq);
+    tcp->ack_seq = htonl(ack_seq);
+    tcp->doff = 5;
+    tcp->syn = syn ? 1 : 0;
+    tcp->ack = ack ? 1 : 0;
+    tcp->window = htons(8192);
+    tcp->check = 0;
+    tcp->urg_ptr = 0;
+    tcp->check = tcp_checksum(ip, tcp, sizeof(struct tcphdr));
+    return length;
+}
+
+// Classic pcap files (not pcapng), either byte order, micro- or nanosecond timestamps.
+class PcapReader {
+public:
+    bool open(const std::string &path) {
+        file_ = fopen(path.c_str(), "rb");
+        if (!file_) {
+            perror(path.c_str());
+            return false;
+        }
+        uint32_t header[6];
+        if (fread(header, sizeof(header), 1, file_) != 1) return fail("short pcap header");
+        uint32_t magic = header[0];
+        if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+            swapped_ = false;
+        } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+            swapped_ = true;
+            magic = __builtin_bswap32(magic);
+        } else {
+            return fail("not a pcap file (pcapng is not supported)");
+        }
+        nanoseconds_ = magic == 0xa1b23c4d;
+        linktype_ = field(header[5]) & 0x0fffffff;
+        if (linktype_ != LINKTYPE_ETHERNET && linktype_ != LINKTYPE_RAW && linktype_ != LINKTYPE_IPV4 &&
+            linktype_ != LINKTYPE_LINUX_SLL && linktype_ != LINKTYPE_NULL) {
+            return fail("unsupported link type " + std::to_string(linktype_));
+        }
+        return true;
+    }
+
+    ~PcapReader() {
+        if (file_) fclose(file_);
+    }
+
+    // The next IPv4 TCP packet, starting at its IP header, with its capture time. Everything else
+    // in the file is skipped. Returns false at the end of the file.
+    bool next(std::vector<char> &packet, uint64_t &time_ns) {
+        uint32_t record[4];
+        while (fread(record, sizeof(record), 1, file_) == 1) {
+            uint32_t captured = field(record[2]);
+            record_.resize(captured);
+            if (captured && fread(record_.data(), captured, 1, file_) != 1) break;
+            time_ns = field(record[0]) * 1000000000ull + field(record[1]) * (nanoseconds_ ? 1ull : 1000ull);
+
+            size_t offset = 0;
+            uint16_t ethertype = 0x0800;
+            if (linktype_ == LINKTYPE_ETHERNET) {
+                offset = 14;
+                if (captured < offset) continue;
+                ethertype = (uint8_t(record_[12]) << 8) | uint8_t(record_[13]);
+                if (ethertype == 0x8100 && captured >= 18) {  // one VLAN tag
+                    ethertype = (uint8_t(record_[16]) << 8) | uint8_t(record_[17]);
+                    offset = 18;
+                }
+            } else if (linktype_ == LINKTYPE_LINUX_SLL) {
+                offset = 16;
+                if (captured < offset) continue;
+                ethertype = (uint8_t(record_[14]) << 8) | uint8_t(record_[15]);
+            } else if (linktype_ == LINKTYPE_NULL) {
+                offset = 4;  // address family in the capturing host's byte order
+            }
+            if (ethertype != 0x0800 || captured < offset + sizeof(struct iphdr)) continue;
+
+            const struct iphdr *ip = (const struct iphdr *)&record_[offset];
+            size_t ip_length = ntohs(ip->tot_len);
+            if (ip->version != 4 || ip->protocol != IPPROTO_TCP || (ntohs(ip->frag_off) & 0x1fff)) continue;
+            // Only whole packets can be replayed.
+            if (ip_length > captured - offset || ip_length < ip->ihl * 4u + sizeof(struct tcphdr)) continue;
+            packet.assign(record_.begin() + offset, record_.begin() + offset + ip_length);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    static constexpr uint32_t LINKTYPE_NULL = 0;
+    static constexpr uint32_t LINKTYPE_ETHERNET = 1;
+    static constexpr uint32_t LINKTYPE_RAW = 101;
+    static constexpr uint32_t LINKTYPE_LINUX_SLL = 113;
+    static constexpr uint32_t LINKTYPE_IPV4 = 228;
+
+    bool fail(const std::string &message) {
+        std::cerr << "Cannot replay: " << message << std::endl;
+        return false;
+    }
+
+    uint32_t field(uint32_t value) const { return swapped_ ? __builtin_bswap32(value) : value; }
+
+    FILE *file_ = nullptr;
+    bool swapped_ = false;
+    bool nanoseconds_ = false;
+    uint32_t linktype_ = 0;
+    std::vector<char> record_;
+};
+
+// Writes the SYNs the benchmark sends as a raw-IPv4 pcap, so a run can be replayed later. The final
+// ACKs are left out: they only fit the ISNs the server chose in that run.
+class PcapWriter {
+public:
+    bool open(const std::string &path) {
+        file_ = fopen(path.c_str(), "wb");
+        if (!file_) {
+            perror(path.c_str());
+            return false;
+        }
+        uint32_t header[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 65535, 101};
+        fwrite(header, sizeof(header), 1, file_);
+        return true;
+    }
+
+    ~PcapWriter() {
+        if (file_) fclose(file_);
+    }
+
+    void write(const char *packet, size_t length) {
+        if (!file_) return;
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        uint32_t record[4] = {uint32_t(now.tv_sec), uint32_t(now.tv_usec), uint32_t(length), uint32_t(length)};
+        fwrite(record, sizeof(record), 1, file_);
+        fwrite(packet, length, 1, file_);
+    }
+
+private:
+    FILE *file_ = nullptr;
+};
+
+// Where the packets to send come from.
+class PacketSource {
+public:
+    virtual ~PacketSource() = default;
+    // Builds the next packet into slot (PACKET_SLOT bytes). due_ns is when to send it, relative
+    // to the start of the run. Returns 0 when there are no more.
+    virtual size_t next(char *slot, uint64_t &due_ns) = 0;
+};
+
+// SYNs for connection 0, 1, 2... from 127.0.1.1:1024, 127.0.1.1:1025, ... spread round-robin
+// over the source addresses.
+class SynStorm : public PacketSource {
+public:
+    SynStorm(const BenchOptions &options) : options_(options) {
+        daddr_ = inet_addr("127.0.0.1");
+        build_tcp_packet(template_, address(0), daddr_, htons(FIRST_SOURCE_PORT), htons(options.port), isn(0), 0,
+                         true, false);
+    }
+
+    size_t next(char *slot, uint64_t &due_ns) override {
+        if (sent_ == options_.count) return 0;
+        uint64_t id = sent_++;
+        due_ns = options_.rate ? id * 1000000000ull / options_.rate : 0;
+        uint32_t saddr = address(id % options_.sources);
+        uint16_t sport = htons(FIRST_SOURCE_PORT + id / options_.sources);
+        if (!options_.incremental) {
+            return build_tcp_packet(slot, saddr, daddr_, sport, htons(options_.port), isn(id), 0, true, false);
+        }
+
+        // Same SYN, other source and sequence number: patch the checksum for the changed fields.
+        struct iphdr *ip = (struct iphdr *)template_;
+        struct tcphdr *tcp = (struct tcphdr *)(template_ + sizeof(struct iphdr));
+        uint32_t seq = htonl(isn(id));
+        uint16_t check = checksum_update32(tcp->check, ip->saddr, saddr);
+        check = checksum_update16(check, tcp->source, sport);
+        tcp->check = checksum_update32(check, tcp->seq, seq);
+        ip->saddr = saddr;
+        tcp->source = sport;
+        tcp->seq = seq;
+        std::memcpy(slot, template_, sizeof(template_));
+        return sizeof(template_);
+    }
+
+private:
+    static uint32_t address(uint32_t index) { return htonl((127u << 24) + (1u << 8) + 1 + index); }
+    static uint32_t isn(uint64_t id) { return static_cast<uint32_t>(id * 2654435761u); }
+
+    const BenchOptions &options_;
+    uint32_t daddr_;
+    uint64_t sent_ = 0;
+    char template_[sizeof(struct iphdr) + sizeof(struct tcphdr)] = {};
+};
+
+class PcapReplay : public PacketSource {
+public:
+    PcapReplay(const BenchOptions &options, PcapReader &reader) : options_(options), reader_(reader) {}
+
+    size_t next(char *slot, uint64_t &due_ns) override {
+        uint64_t time_ns;
+        do {
+            if (!reader_.next(packet_, time_ns)) return 0;
+        } while (packet_.size() > PACKET_SLOT || (options_.ack && !is_syn(packet_)));
+        if (sent_ == 0) first_ns_ = time_ns;
+        due_ns = options_.rate ? sent_ * 1000000000ull / options_.rate : time_ns - first_ns_;
+        ++sent_;
+        std::memcpy(slot, packet_.data(), packet_.size());
+
+        if (options_.rewrite) {
+            // Aim the packet at the server from a loopback source, so that its SYN-ACK stays on this
+            // host too, and patch the TCP checksum.
+            struct iphdr *ip = (struct iphdr *)slot;
+            struct tcphdr *tcp = (struct tcphdr *)(slot + ip->ihl * 4);
+            uint32_t saddr = loopback_address(ip->saddr);
+            uint32_t daddr = inet_addr("127.0.0.1");
+            uint16_t dport = htons(options_.port);
+            uint16_t check = checksum_update32(tcp->check, ip->saddr, saddr);
+            check = checksum_update32(check, ip->daddr, daddr);
+            tcp->check = checksum_update16(check, tcp->dest, dport);
+            ip->saddr = saddr;
+            ip->daddr = daddr;
+            tcp->dest = dport;
+            ip->check = 0;  // the kernel fills it in
+        }
+        return packet_.size();
+    }
+
+private:
+    // While the benchmark sends the final ACKs itself, a capture's other packets are left out: their
+    // acknowledgment numbers belong to another server's ISNs.
+    static bool is_syn(const std::vector<char> &packet) {
+        const struct iphdr *ip = (const struct iphdr *)packet.data();
+        const struct tcphdr *tcp = (const struct tcphdr *)(packet.data() + ip->ihl * 4);
+        return tcp->syn && !tcp->ack;
+    }
+
+    // Maps a captured source address into 127.0.0.0/8, always to the same address, with the last
+    // byte kept away from 0 and 255.
+    static uint32_t loopback_address(uint32_t saddr) {
+        uint32_t hash = ntohl(saddr) * 2654435761u;
+        return htonl((127u << 24) | ((hash >> 8) & 0xffff00) | (1 + hash % 254));
+    }
+
+    const BenchOptions &options_;
+    PcapReader &reader_;
+    std::vector<char> packet_;
+    uint64_t first_ns_ = 0;
+    uint64_t sent_ = 0;
+};
+
+// A connection the benchmark sent a SYN for, keyed by its source address and port.
+struct Pending {
+    uint32_t isn;
+    uint64_t sent_ns;  // 0 until the SYN has actually gone out
+    bool answered;
+};
+
+uint64_t connection_key(uint32_t addr, uint16_t port) { return (uint64_t(addr) << 16) | port; }
+
+void print_percentiles(std::vector<uint32_t> &latencies_ns) {
+    if (latencies_ns.empty()) {
+        std::cout << "[+] Reply latency: no replies" << std::endl;
+        return;
+    }
+    std::sort(latencies_ns.begin(), latencies_ns.end());
+    auto at = [&](double fraction) {
+        size_t index = static_cast<size_t>(fraction * (latencies_ns.size() - 1));
+        return latencies_ns[index] / 1000.0;
+    };
+    std::cout << "[+] SYN -> SYN-ACK latency (us): p50 " << at(0.5) << "  p90 " << at(0.9) << "  p99 " << at(0.99)
+              << "  p99.9 " << at(0.999) << "  max " << at(1.0) << std::endl;
+}
+
+void usage(const char *program) {
+    std::cerr << "Usage: " << program << " [--port N] [--count N] [--rate N] [--sources N] [--no-ack]"
+              << " [--checksum incremental|full] [--replay FILE [--no-rewrite]] [--write FILE] [--wait MS]"
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-ack") {
+            options.ack = false;
+            continue;
+        }
+        if (arg == "--no-rewrite") {
+            options.rewrite = false;
+            continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        std::string value = argv[++i];
+        if (arg == "--port") options.port = std::atoi(value.c_str());
+        else if (arg == "--count") options.count = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--rate") options.rate = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--sources") options.sources = std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--replay") options.replay = value;
+        else if (arg == "--write") options.write = value;
+        else if (arg == "--wait") options.wait_ms = std::strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--checksum" && value == "full") options.incremental = false;
+        else if (arg == "--checksum" && value == "incremental") options.incremental = true;
+        else usage(argv[0]);
+    }
+    if (options.sources == 0 || options.sources > 254) usage(argv[0]);
+    // Every connection needs its own source port on its address.
+    if (options.count > 254ull * PORTS_PER_ADDRESS) {
+        std::cerr << "At most " << 254ull * PORTS_PER_ADDRESS << " connections per run" << std::endl;
+        return 1;
+    }
+    uint32_t needed = static_cast<uint32_t>((options.count + PORTS_PER_ADDRESS - 1) / PORTS_PER_ADDRESS);
+    options.sources = std::max(options.sources, needed);
+
+    PcapReader reader;
+    PcapWriter writer;
+    if (!options.replay.empty() && !reader.open(options.replay)) return 1;
+    if (!options.write.empty() && !writer.open(options.write)) return 1;
+
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return 1;
+    }
+    int one = 1;
+    if (setsockopt(sock, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
+        perror("setsockopt() failed");
+        return 1;
+    }
+    tune_raw_socket(sock);
+    // Only the server's SYN-ACKs reach us.
+    TcpMatch match;
+    match.src_port = options.port;
+    match.flags_mask = 0x12;  // SYN | ACK
+    match.flags_value = 0x12;
+    attach_tcp_filter(sock, match);
+
+    SynStorm storm(options);
+    PcapReplay replay(options, reader);
+    PacketSource &source = options.replay.empty() ? static_cast<PacketSource &>(storm) : replay;
+
+    std::unordered_map<uint64_t, Pending> pending;
+    if (options.replay.empty()) pending.reserve(options.count);
+    std::vector<Pending *> stamped;  // SYNs in the batch being built, stamped when it is sent
+    std::vector<uint32_t> latencies_ns;
+
+    RxBatch rx;
+    TxBatch tx;
+    TxBatch acks;
+    uint64_t packets_sent = 0, syns_sent = 0, replies = 0, duplicates = 0, unknown = 0, acks_sent = 0;
+    uint64_t first_reply_ns = 0, last_reply_ns = 0;
+
+    char lookahead[PACKET_SLOT];
+    uint64_t lookahead_due = 0;
+    size_t lookahead_length = source.next(lookahead, lookahead_due);
+
+    uint64_t start = monotonic_ns();
+    uint64_t last_send = start;
+    while (true) {
+        uint64_t now = monotonic_ns();
+        bool busy = false;
+
+        // Send whatever is due, a batch at a time.
+        while (lookahead_length && start + lookahead_due <= now && !tx.full()) {
+            char *slot = tx.slot();
+            std::memcpy(slot, lookahead, lookahead_length);
+            struct iphdr *ip = (struct iphdr *)slot;
+            struct tcphdr *tcp = (struct tcphdr *)(slot + ip->ihl * 4);
+            struct sockaddr_in to = {};
+            to.sin_family = AF_INET;
+            to.sin_addr.s_addr = ip->daddr;
+            if (tcp->syn && !tcp->ack) {
+                Pending &connection = pending[connection_key(ip->saddr, tcp->source)];
+                connection = Pending{ntohl(tcp->seq), 0, false};
+                stamped.push_back(&connection);
+                ++syns_sent;
+                writer.write(slot, lookahead_length);
+            }
+            tx.commit(lookahead_length, to);
+            lookahead_length = source.next(lookahead, lookahead_due);
+        }
+        if (!tx.empty()) {
+            uint64_t sent_ns = monotonic_ns();
+            packets_sent += tx.flush(sock);
+            for (Pending *connection : stamped) connection->sent_ns = sent_ns;
+            stamped.clear();
+            last_send = sent_ns;
+            busy = true;
+        }
+
+        // Take every SYN-ACK already queued and answer it.
+        int count;
+        while ((count = rx.receive(sock, MSG_DONTWAIT)) > 0) {
+            uint64_t received_ns = monotonic_ns();
+            busy = true;
+            for (int i = 0; i < count; ++i) {
+                const struct iphdr *ip = (const struct iphdr *)rx.data(i);
+                if (rx.size(i) < ip->ihl * 4u + sizeof(struct tcphdr)) continue;
+                const struct tcphdr *tcp = (const struct tcphdr *)(rx.data(i) + ip->ihl * 4);
+                auto it = pending.find(connection_key(ip->daddr, tcp->dest));
+                if (it == pending.end() || it->second.sent_ns == 0 || ntohl(tcp->ack_seq) != it->second.isn + 1) {
+                    ++unknown;
+                    continue;
+                }
+                Pending &connection = it->second;
+                if (connection.answered) {
+                    ++duplicates;
+                    continue;
+                }
+                connection.answered = true;
+                ++replies;
+                latencies_ns.push_back(static_cast<uint32_t>(std::min<uint64_t>(received_ns - connection.sent_ns, UINT32_MAX)));
+                if (!first_reply_ns) first_reply_ns = received_ns;
+                last_reply_ns = received_ns;
+
+                if (options.ack) {
+                    if (acks.full()) acks_sent += acks.flush(sock);
+                    char *slot = acks.slot();
+                    size_t length = build_tcp_packet(slot, ip->daddr, ip->saddr, tcp->dest, tcp->source,
+                                                     connection.isn + 1, ntohl(tcp->seq) + 1, false, true);
+                    struct sockaddr_in to = {};
+                    to.sin_family = AF_INET;
+                    to.sin_addr.s_addr = ip->saddr;
+                    acks.commit(length, to);
+                }
+            }
+            if (!acks.empty()) acks_sent += acks.flush(sock);
+            if (count < PACKET_BATCH) break;
+        }
+
+        if (!lookahead_length && (replies == syns_sent || now >= last_send + options.wait_ms * 1000000ull)) break;
+        if (busy) continue;
+
+        // Idle: sleep until the next packet is due or a reply arrives.
+        uint64_t wake = lookahead_length ? start + lookahead_due : last_send + options.wait_ms * 1000000ull;
+        struct pollfd poller = {sock, POLLIN, 0};
+        struct timespec timeout = {0, 0};
+        if (wake > now) {
+            timeout.tv_sec = (wake - now) / 1000000000ull;
+            timeout.tv_nsec = (wake - now) % 1000000000ull;
+        }
+        ppoll(&poller, 1, &timeout, nullptr);
+    }
+
+    double sending = (last_send - start) / 1e9;
+    double replying = first_reply_ns ? (last_reply_ns - start) / 1e9 : 0;
+    std::cout << "[+] Sent " << packets_sent << " packets (" << syns_sent << " SYNs) in " << sending << " s, "
+              << (sending > 0 ? syns_sent / sending : 0) << " SYNs/s" << std::endl;
+    std::cout << "[+] SYN-ACKs: " << replies << ", " << (replying > 0 ? replies / replying : 0) << "/s";
+    if (options.ack) {
+        std::cout << "; handshakes completed (final ACK sent): " << acks_sent << ", "
+                  << (replying > 0 ? acks_sent / replying : 0) << "/s";
+    }
+    std::cout << std::endl;
+    print_percentiles(latencies_ns);
+    std::cout << "[+] Unanswered SYNs: " << syns_sent - replies << ", duplicate SYN-ACKs: " << duplicates
+              << ", unexpected SYN-ACKs: " << unknown << ", dropped by the kernel on our socket: " << rx.drops()
+              << std::endl;
+
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,150 @@
+// Batched raw-socket I/O shared by the handshake programs.
+//
+// Instead of one recvfrom()/sendto() per packet, RxBatch pulls up to a whole batch of packets out
+// of the socket with one recvmmsg() and TxBatch sends every queued reply with one sendmmsg().
+// Each batch owns a fixed pool of packet slots plus the mmsghdr/iovec/address arrays the calls
+// need, all allocated once up front, so the packet path itself never allocates.
+
+#ifndef A3_PACKET_IO_H
+#define A3_PACKET_IO_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Big enough for the IP and TCP headers with all options; anything longer is truncated, which is
+// fine because only the headers are ever looked at.
+#define PACKET_SLOT 256
+#define PACKET_BATCH 64
+
+// A SOCK_RAW/IPPROTO_TCP socket sees every TCP packet on the host, so give the kernel room to queue
+// bursts, and ask it to count what it drops anyway (read back through RxBatch::drops()).
+inline void tune_raw_socket(int sock, int buffer_bytes = 8 << 20) {
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_bytes, sizeof(buffer_bytes)) < 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_bytes, sizeof(buffer_bytes));
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &buffer_bytes, sizeof(buffer_bytes)) < 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_bytes, sizeof(buffer_bytes));
+    }
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+}
+
+class RxBatch {
+public:
+    explicit RxBatch(int capacity = PACKET_BATCH)
+        : slots_(capacity * PACKET_SLOT), control_(capacity * CONTROL_SIZE),
+          iov_(capacity), addrs_(capacity), msgs_(capacity) {
+        for (int i = 0; i < capacity; ++i) {
+            iov_[i].iov_base = &slots_[i * PACKET_SLOT];
+            iov_[i].iov_len = PACKET_SLOT;
+        }
+    }
+
+    // Blocks until at least one packet is queued, then takes whatever else is already waiting, up
+    // to the batch size. Returns the number of packets, or -1 with errno set. With MSG_DONTWAIT
+    // for flags it returns -1/EAGAIN instead of blocking when nothing is queued.
+    int receive(int sock, int flags = MSG_WAITFORONE) {
+        int capacity = static_cast<int>(msgs_.size());
+        for (int i = 0; i < capacity; ++i) {
+            msghdr& header = msgs_[i].msg_hdr;
+            header.msg_name = &addrs_[i];
+            header.msg_namelen = sizeof(sockaddr_in);
+            header.msg_iov = &iov_[i];
+            header.msg_iovlen = 1;
+            header.msg_control = &control_[i * CONTROL_SIZE];
+            header.msg_controllen = CONTROL_SIZE;
+            header.msg_flags = 0;
+        }
+        int count = recvmmsg(sock, msgs_.data(), capacity, flags, nullptr);
+        for (int i = 0; i < count; ++i) {
+            msghdr& header = msgs_[i].msg_hdr;
+            for (cmsghdr* c = CMSG_FIRSTHDR(&header); c; c = CMSG_NXTHDR(&header, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+                    std::memcpy(&drops_, CMSG_DATA(c), sizeof(drops_));
+                }
+            }
+        }
+        return count;
+    }
+
+    const char* data(int i) const { return &slots_[i * PACKET_SLOT]; }
+    // Bytes captured, at most PACKET_SLOT.
+    size_t size(int i) const { return msgs_[i].msg_len < PACKET_SLOT ? msgs_[i].msg_len : PACKET_SLOT; }
+    const sockaddr_in& from(int i) const { return addrs_[i]; }
+    // Packets the kernel dropped on this socket because its queue was full, since it was opened.
+    uint32_t drops() const { return drops_; }
+
+private:
+    static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(uint32_t));
+
+    std::vector<char> slots_;
+    std::vector<char> control_;
+    std::vector<iovec> iov_;
+    std::vector<sockaddr_in> addrs_;
+    std::vector<mmsghdr> msgs_;
+    uint32_t drops_ = 0;
+};
+
+class TxBatch {
+public:
+    explicit TxBatch(int capacity = PACKET_BATCH)
+        : slots_(capacity * PACKET_SLOT), iov_(capacity), addrs_(capacity), msgs_(capacity) {}
+
+    bool full() const { return count_ == static_cast<int>(msgs_.size()); }
+    bool empty() const { return count_ == 0; }
+
+    // The next free slot, zeroed, to build a packet of up to PACKET_SLOT bytes in. The caller must
+    // flush() first if the batch is full.
+    char* slot() {
+        char* packet = &slots_[count_ * PACKET_SLOT];
+        std::memset(packet, 0, PACKET_SLOT);
+        return packet;
+    }
+
+    // Queues the packet just built in slot().
+    void commit(size_t length, const sockaddr_in& to) {
+        iov_[count_].iov_base = &slots_[count_ * PACKET_SLOT];
+        iov_[count_].iov_len = length;
+        addrs_[count_] = to;
+        msghdr& header = msgs_[count_].msg_hdr;
+        header = msghdr{};
+        header.msg_name = &addrs_[count_];
+        header.msg_namelen = sizeof(sockaddr_in);
+        header.msg_iov = &iov_[count_];
+        header.msg_iovlen = 1;
+        ++count_;
+    }
+
+    // Sends everything queued, normally in one sendmmsg(). A packet the kernel refuses is reported
+    // and skipped. Returns how many were sent.
+    int flush(int sock) {
+        int sent = 0;
+        for (int next = 0; next < count_;) {
+            int n = sendmmsg(sock, &msgs_[next], count_ - next, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("sendmmsg() failed");
+                ++next;
+                continue;
+            }
+            sent += n;
+            next += n;
+        }
+        count_ = 0;
+        return sent;
+    }
+
+private:
+    std::vector<char> slots_;
+    std::vector<iovec> iov_;
+    std::vector<sockaddr_in> addrs_;
+    std::vector<mmsghdr> msgs_;
+    int count_ = 0;
+};
+
+#endif
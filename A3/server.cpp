@@ -1,11 +1,17 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <csignal>
+#include <string>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include "checksum.h"
+#include "handshake.h"
+#include "packet_io.h"
+#include "socket_filter.h"
 
 #define SERVER_PORT 12345  // Listening port
 
@@ -16,48 +22,104 @@ void print_tcp_flags(struct tcphdr *tcp) {
               << " FIN: " << tcp->fin
               << " RST: " << tcp->rst
               << " PSH: " << tcp->psh
-              << " SEQ: " << ntohl(tcp->seq) << std::endl;
+              << " SEQ: " << ntohl(tcp->seq) << '\n';
 }
 
-void send_syn_ack(int sock, struct sockaddr_in *client_addr, struct tcphdr *tcp) {
-    char packet[sizeof(struct iphdr) + sizeof(struct tcphdr)];
-    memset(packet, 0, sizeof(packet));
+// Builds the SYN-ACK answering the SYN in ip/tcp into packet (a zeroed TxBatch slot) and returns
+// its length. It is sent later, together with every other reply from the same receive batch.
+size_t build_syn_ack(char *packet, const struct iphdr *ip, const struct tcphdr *tcp, const Reply &reply) {
+    const size_t options_length = 4;  // MSS
+    const size_t length = sizeof(struct iphdr) + sizeof(struct tcphdr) + options_length;
 
-    struct iphdr *ip = (struct iphdr *)packet;
+    struct iphdr *ip_response = (struct iphdr *)packet;
     struct tcphdr *tcp_response = (struct tcphdr *)(packet + sizeof(struct iphdr));
+    uint8_t *options = (uint8_t *)(tcp_response + 1);
 
     // Fill IP header
-    ip->ihl = 5;
-    ip->version = 4;
-    ip->tos = 0;
-    ip->tot_len = htons(sizeof(packet));
-    ip->id = htons(54321);
-    ip->frag_off = 0;
-    ip->ttl = 64;
-    ip->protocol = IPPROTO_TCP;
-    ip->saddr = client_addr->sin_addr.s_addr;
-    ip->daddr = inet_addr("127.0.0.1");  // Server address
+    ip_response->ihl = 5;
+    ip_response->version = 4;
+    ip_response->tos = 0;
+    ip_response->tot_len = htons(length);
+    ip_response->id = htons(54321);
+    ip_response->frag_off = 0;
+    ip_response->ttl = 64;
+    ip_response->protocol = IPPROTO_TCP;
+    ip_response->saddr = ip->daddr;  // the address the SYN was sent to
+    ip_response->daddr = ip->saddr;
 
     // Fill TCP header
     tcp_response->source = tcp->dest;
     tcp_response->dest = tcp->source;
-    tcp_response->seq = htonl(400);
-    tcp_response->ack_seq = htonl(ntohl(tcp->seq) + 1);
-    tcp_response->doff = 5;
+    tcp_response->seq = htonl(reply.seq);
+    tcp_response->ack_seq = htonl(reply.ack_seq);
+    tcp_response->doff = (sizeof(struct tcphdr) + options_length) / 4;
     tcp_response->syn = 1;
     tcp_response->ack = 1;
     tcp_response->window = htons(8192);
-    tcp_response->check = 0;  // Kernel will compute the checksum
 
-    // Send packet
-    if (sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0) {
-        perror("sendto() failed");
-    } else {
-        std::cout << "[+] Sent SYN-ACK" << std::endl;
+    options[0] = TCPOPT_MAXSEG;
+    options[1] = TCPOLEN_MAXSEG;
+    options[2] = reply.mss >> 8;
+    options[3] = reply.mss & 0xff;
+
+    // With IP_HDRINCL the kernel fills in the IP checksum, but the TCP one is ours to compute.
+    tcp_response->check = tcp_checksum(ip_response, tcp_response, length - sizeof(struct iphdr));
+
+    return length;
+}
+
+// The MSS option of a SYN, or 0 if it has none.
+uint16_t parse_mss(const struct tcphdr *tcp, size_t captured) {
+    const uint8_t *options = (const uint8_t *)(tcp + 1);
+    size_t length = tcp->doff * 4;
+    if (length > captured) length = captured;
+    if (length < sizeof(struct tcphdr)) return 0;
+    length -= sizeof(struct tcphdr);
+    for (size_t i = 0; i < length;) {
+        if (options[i] == TCPOPT_EOL) break;
+        if (options[i] == TCPOPT_NOP) {
+            ++i;
+            continue;
+        }
+        if (i + 1 >= length || options[i + 1] < 2 || i + options[i + 1] > length) break;
+        if (options[i] == TCPOPT_MAXSEG && options[i + 1] == TCPOLEN_MAXSEG) {
+            return (options[i + 2] << 8) | options[i + 3];
+        }
+        i += options[i + 1];
     }
+    return 0;
 }
 
-void receive_syn() {
+struct ServerOptions {
+    int port = SERVER_PORT;
+    HandshakeEngine::Options engine;
+    uint64_t count = 1;  // handshakes to complete before exiting; 0 runs until interrupted
+    bool quiet = false;  // no per-packet output, for load tests
+    int batch = PACKET_BATCH;  // packets per recvmmsg()/sendmmsg(); 1 is one syscall per packet
+};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop(int) { stop_requested = 1; }
+
+void print_stats(const HandshakeEngine &engine, double seconds, uint32_t kernel_drops) {
+    const HandshakeEngine::Stats &stats = engine.stats();
+    const HalfOpenTable &table = engine.table();
+    std::cout << "[+] Handshakes completed: " << stats.established
+              << " (by SYN cookie: " << stats.established_by_cookie << ") in " << seconds << " s, "
+              << (seconds > 0 ? stats.established / seconds : 0) << "/s\n"
+              << "    SYNs: " << stats.syns << " (retransmitted: " << stats.syn_retransmits
+              << "), SYN cookies sent: " << stats.cookies_sent
+              << ", dropped with a full backlog: " << stats.backlog_drops << '\n'
+              << "    Half-open expired: " << stats.expired << ", reset: " << stats.resets
+              << ", unmatched ACKs: " << stats.bad_acks
+              << ", packets dropped by the kernel on our socket: " << kernel_drops << '\n'
+              << "    Half-open table: " << table.size() << " now, peak " << table.peak() << " of "
+              << table.limit() << ", " << table.bytes() << " bytes ("
+              << table.bytes() / table.limit() << " per half-open connection)" << std::endl;
+}
+
+void receive_syn(const ServerOptions &options) {
     int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
     if (sock < 0) {
         perror("Socket creation failed");
@@ -71,42 +133,140 @@ void receive_syn() {
         exit(EXIT_FAILURE);
     }
 
-    char buffer[65536];
-    struct sockaddr_in source_addr;
-    socklen_t addr_len = sizeof(source_addr);
+    tune_raw_socket(sock);
+
+    // Let the kernel drop all TCP traffic that is not for us before it is copied out.
+    TcpMatch match;
+    match.dst_port = options.port;
+    attach_tcp_filter(sock, match);
+
+    // Wake up at least every 100 ms even when nothing arrives, to time out half-open connections.
+    struct timeval tick = {0, 100000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tick, sizeof(tick));
 
-    while (true) {
-        int data_size = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &addr_len);
-        if (data_size < 0) {
-            perror("Packet reception failed");
+    HandshakeEngine engine(options.engine);
+    uint64_t started = monotonic_ns();
+
+    // One recvmmsg() per batch of incoming packets and one sendmmsg() for all the replies to it;
+    // both batches keep their packet buffers for the whole run.
+    RxBatch rx(options.batch);
+    TxBatch tx(options.batch);
+    bool done = false;
+
+    while (!done && !stop_requested) {
+        int count = rx.receive(sock);
+        uint64_t now = monotonic_ns();
+        engine.expire(now);
+        if (count < 0) {
+            if (errno != EINTR && errno != EAGAIN) perror("Packet reception failed");
             continue;
         }
 
-        struct iphdr *ip = (struct iphdr *)buffer;
-        struct tcphdr *tcp = (struct tcphdr *)(buffer + (ip->ihl * 4));
+        for (int i = 0; i < count && !done; ++i) {
+            const char *buffer = rx.data(i);
+            size_t data_size = rx.size(i);
+            struct iphdr *ip = (struct iphdr *)buffer;
+            if (data_size < sizeof(struct iphdr) || data_size < ip->ihl * 4 + sizeof(struct tcphdr)) continue;
+            struct tcphdr *tcp = (struct tcphdr *)(buffer + (ip->ihl * 4));
 
-        // Only process packets for the correct destination port
-        if (ntohs(tcp->dest) != SERVER_PORT) continue;
+            // Only process packets for the correct destination port
+            if (ntohs(tcp->dest) != options.port) continue;
 
-        print_tcp_flags(tcp);
+            if (!options.quiet) print_tcp_flags(tcp);
 
-        if (tcp->syn == 1 && tcp->ack == 0 && ntohl(tcp->seq) == 200) {
-            std::cout << "[+] Received SYN from " << inet_ntoa(source_addr.sin_addr) << std::endl;
-            send_syn_ack(sock, &source_addr, tcp);
+            Segment segment;
+            segment.key = {ip->saddr, ip->daddr, tcp->source, tcp->dest};
+            segment.seq = ntohl(tcp->seq);
+            segment.ack_seq = ntohl(tcp->ack_seq);
+            segment.syn = tcp->syn;
+            segment.ack = tcp->ack;
+            segment.rst = tcp->rst;
+            segment.mss = tcp->syn ? parse_mss(tcp, data_size - ip->ihl * 4) : 0;
+
+            Reply reply;
+            switch (engine.handle(segment, now, reply)) {
+            case HandshakeEngine::Event::SendSynAck:
+                if (!options.quiet) std::cout << "[+] Received SYN from " << inet_ntoa(rx.from(i).sin_addr) << '\n';
+                if (tx.full()) tx.flush(sock);
+                tx.commit(build_syn_ack(tx.slot(), ip, tcp, reply), rx.from(i));
+                break;
+            case HandshakeEngine::Event::Established:
+                if (!options.quiet) {
+                    std::cout << "[+] Received ACK, handshake complete." << " (MSS " << reply.mss
+                              << (reply.cookie ? ", SYN cookie" : "") << ")" << '\n';
+                }
+                if (options.count != 0 && engine.stats().established >= options.count) done = true;
+                break;
+            case HandshakeEngine::Event::Reset:
+                if (!options.quiet) std::cout << "[+] Received RST, half-open connection dropped." << '\n';
+                break;
+            case HandshakeEngine::Event::Ignored:
+                break;
+            }
         }
 
-        if (tcp->ack == 1 && tcp->syn == 0 && ntohl(tcp->seq) == 600) {
-            std::cout << "[+] Received ACK, handshake complete." << std::endl;
-            break;
+        int sent = tx.flush(sock);
+        if (!options.quiet) {
+            for (; sent > 0; --sent) std::cout << "[+] Sent SYN-ACK" << '\n';
         }
+        // Output is flushed once per batch rather than once per line.
+        std::cout.flush();
     }
 
+    print_stats(engine, (monotonic_ns() - started) / 1e9, rx.drops());
     close(sock);
 }
 
-int main() {
-    std::cout << "[+] Server listening on port " << SERVER_PORT << "..." << std::endl;
-    receive_syn();
-    return 0;
+void usage(const char *program) {
+    std::cerr << "Usage: " << program << " [--port N] [--backlog N] [--timeout MS]"
+              << " [--syncookies off|auto|always] [--count N] [--quiet] [--accept-resets]"
+              << " [--batch N]" << std::endl;
+    exit(EXIT_FAILURE);
 }
 
+int main(int argc, char *argv[]) {
+    ServerOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quiet") {
+            options.quiet = true;
+            continue;
+        }
+        if (arg == "--accept-resets") {
+            options.engine.accept_resets = true;
+            continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        std::string value = argv[++i];
+        if (arg == "--port") {
+            options.port = std::atoi(value.c_str());
+        } else if (arg == "--backlog") {
+            options.engine.backlog = std::strtoul(value.c_str(), nullptr, 10);
+            if (options.engine.backlog == 0) usage(argv[0]);
+        } else if (arg == "--timeout") {
+            options.engine.timeout_ms = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--syncookies") {
+            if (value == "off") options.engine.cookies = CookieMode::Off;
+            else if (value == "auto") options.engine.cookies = CookieMode::Auto;
+            else if (value == "always") options.engine.cookies = CookieMode::Always;
+            else usage(argv[0]);
+        } else if (arg == "--batch") {
+            options.batch = std::atoi(value.c_str());
+            if (options.batch < 1) usage(argv[0]);
+        } else if (arg == "--count") {
+            options.count = std::strtoull(value.c_str(), nullptr, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // Ctrl-C stops the server and prints its statistics; no SA_RESTART, so a blocked receive returns.
+    struct sigaction action = {};
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    std::cout << "[+] Server listening on port " << options.port << "..." << std::endl;
+    receive_syn(options);
+    return 0;
+}
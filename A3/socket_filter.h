@@ -0,0 +1,84 @@
+// Kernel-side packet filter for the raw TCP sockets of the handshake programs.
+//
+// A SOCK_RAW/IPPROTO_TCP socket receives a copy of every TCP packet on the host. Without a filter
+// each one is copied to userspace just to fail a port check. attach_tcp_filter() installs a
+// classic BPF program (SO_ATTACH_FILTER) that runs on the IP header the socket sees and only lets
+// through the packets the program asks for, truncated to the headers.
+
+#ifndef A3_SOCKET_FILTER_H
+#define A3_SOCKET_FILTER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+
+struct TcpMatch {
+    int dst_port = -1;        // -1 matches any
+    int src_port = -1;
+    uint8_t flags_mask = 0;   // TCP flag byte (FIN 0x01, SYN 0x02, RST 0x04, PSH 0x08, ACK 0x10)
+    uint8_t flags_value = 0;  // required value of the bits in flags_mask
+    uint32_t snap_length = 256;  // bytes passed up; the programs only read headers
+};
+
+// Builds the program for match. Every test that fails jumps to the final "drop" instruction.
+inline std::vector<sock_filter> build_tcp_filter(const TcpMatch& match) {
+    std::vector<sock_filter> program;
+    std::vector<size_t> to_drop;  // conditional jumps whose false branch must reach "drop"
+    auto require_equal = [&](uint32_t value) {
+        to_drop.push_back(program.size());
+        program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0));
+    };
+
+    program.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9));           // IP protocol
+    require_equal(IPPROTO_TCP);
+    program.push_back(BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6));           // flags + fragment offset
+    to_drop.push_back(program.size());                                   // later fragments have no TCP header
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 0, 0));
+    program.push_back(BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0));           // X = IP header length
+    if (match.dst_port >= 0) {
+        program.push_back(BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2));
+        require_equal(static_cast<uint32_t>(match.dst_port));
+    }
+    if (match.src_port >= 0) {
+        program.push_back(BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0));
+        require_equal(static_cast<uint32_t>(match.src_port));
+    }
+    if (match.flags_mask != 0) {
+        program.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13));
+        program.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, match.flags_mask));
+        require_equal(match.flags_value & match.flags_mask);
+    }
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, match.snap_length));
+    size_t drop = program.size();
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+    for (size_t at : to_drop) {
+        sock_filter& jump = program[at];
+        uint8_t offset = static_cast<uint8_t>(drop - at - 1);
+        // JSET drops when a bit is set (true branch); the equality tests drop on mismatch.
+        if (BPF_OP(jump.code) == BPF_JSET) jump.jt = offset;
+        else jump.jf = offset;
+    }
+    return program;
+}
+
+// Attaches the filter and discards whatever the socket queued before it was in place, so the
+// caller only ever sees matching packets. Returns false (with a message) if the kernel refused it;
+// the socket then keeps receiving everything, which the callers' own checks still handle.
+inline bool attach_tcp_filter(int sock, const TcpMatch& match) {
+    std::vector<sock_filter> program = build_tcp_filter(match);
+    sock_fprog fprog{static_cast<unsigned short>(program.size()), program.data()};
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        perror("SO_ATTACH_FILTER failed");
+        return false;
+    }
+    char discard[1];
+    while (recv(sock, discard, sizeof(discard), MSG_DONTWAIT | MSG_TRUNC) >= 0) {
+    }
+    return true;
+}
+
+#endif
@@ -1,4 +1,3 @@
-
 #include <iostream>
 #include <vector>
 #include <limits>
@@ -6,175 +5,980 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <atomic>
+#include <thread>
 
 using namespace std;
 
+// "No link" in the input, and the cost printed for a destination that cannot be reached
 const int INF = 9999;
 
+// Distance of an unreachable node inside the shortest-path computations. On large topologies a
+// path can legitimately cost more than INF, so INF is only used for input and output.
+const int UNREACHABLE = numeric_limits<int>::max();
+
+// The DVR tables, and the LSR trees kept for replaying link events, are n x n, so they are only
+// built up to this many nodes
+const int MAX_TABLE_NODES = 10000;
+
+// One directed link of the topology
+struct Edge {
+    int from;
+    int to;
+    int cost;
+};
+
+// The topology in compressed sparse row (CSR) form. The links leaving node u are
+// targets[offsets[u]] .. targets[offsets[u + 1] - 1], sorted by neighbor, and costs[] holds their
+// costs at the same positions. It needs O(n + m) memory where an adjacency matrix needs O(n^2),
+// and a node's links sit next to each other in memory.
+struct Graph {
+    int n = 0;
+    vector<int> offsets;
+    vector<int> targets;
+    vector<int> costs;
+
+    int links() const { return targets.size(); }
+};
+
+// This function builds the CSR graph from a list of directed links
+// Self-loops are dropped, and of several links between the same two nodes only the cheapest is kept
+Graph buildGraph(int n, vector<Edge>& edges) {
+    sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+        if (a.from != b.from) return a.from < b.from;
+        if (a.to != b.to) return a.to < b.to;
+        return a.cost < b.cost;
+    });
+
+    Graph graph;
+    graph.n = n;
+    graph.offsets.assign(n + 1, 0);
+    graph.targets.reserve(edges.size());
+    graph.costs.reserve(edges.size());
+    for (size_t e = 0; e < edges.size(); ++e) {
+        const Edge& edge = edges[e];
+        if (edge.from == edge.to) continue;
+        if (e > 0 && edges[e - 1].from == edge.from && edges[e - 1].to == edge.to) continue;
+        graph.targets.push_back(edge.to);
+        graph.costs.push_back(edge.cost);
+        ++graph.offsets[edge.from + 1];
+    }
+    for (int u = 0; u < n; ++u) graph.offsets[u + 1] += graph.offsets[u];
+    return graph;
+}
+
+// This function returns the position of link u -> v in the CSR arrays, or -1 if there is no such link
+int findLink(const Graph& graph, int u, int v) {
+    auto first = graph.targets.begin() + graph.offsets[u], last = graph.targets.begin() + graph.offsets[u + 1];
+    auto link = lower_bound(first, last, v);
+    return link != last && *link == v ? link - graph.targets.begin() : -1;
+}
+
+// This function runs body(worker, i) for every i in [begin, end) on the given number of threads
+// The indices are handed out a few at a time from a shared counter, so a thread that draws cheap
+// ones simply comes back for more and all threads finish at about the same time.
+void parallelFor(int threads, int begin, int end, const function<void(int, int)>& body) {
+    if (threads <= 1 || end - begin <= 1) {
+        for (int i = begin; i < end; ++i) body(0, i);
+        return;
+    }
+    const int chunk = max(1, min(16, (end - begin) / (threads * 8)));
+    atomic<int> next(begin);
+    auto work = [&](int worker) {
+        for (int first; (first = next.fetch_add(chunk)) < end;) {
+            for (int i = first; i < min(first + chunk, end); ++i) body(worker, i);
+        }
+    };
+    vector<thread> pool;
+    for (int t = 1; t < threads; ++t) pool.emplace_back(work, t);
+    work(0);
+    for (thread& t : pool) t.join();
+}
+
+// This function returns the graph with every link reversed
+// For each node it lists the nodes that have a link to it, which are the ones that hear its advertisements.
+Graph reverseGraph(const Graph& graph) {
+    vector<Edge> edges;
+    edges.reserve(graph.links());
+    for (int u = 0; u < graph.n; ++u) {
+        for (int e = graph.offsets[u]; e < graph.offsets[u + 1]; ++e) edges.push_back({graph.targets[e], u, graph.costs[e]});
+    }
+    return buildGraph(graph.n, edges);
+}
+
+// One entry of the batch a node sends to its neighbors: its new cost to reach dest, and the neighbor
+// that route leaves through
+struct RouteAdvert {
+    int dest;
+    int cost;
+    int nextHop;
+};
+
+// A distance-vector network in the middle of (or after) its exchange of routes
+// Each node keeps only its own row of dist and nextHop. The nodes whose routes changed in the last
+// round are listed in senders, and their batches of changed routes lie back to back in batches:
+// node k's is batches[batchBegin[k]] .. batches[batchEnd[k] - 1]. Every node with a link to k reads
+// k's batch from there in the next round, which is the same as k queueing a copy for each of them.
+struct DVRNetwork {
+    Graph graph;
+    Graph reverse;
+    int n = 0;
+    vector<int> dist;     // dist[i * n + j], node i's cost to reach j; UNREACHABLE if it knows no route
+    vector<int> nextHop;  // -1 for the node itself and for destinations it cannot reach
+    vector<int> senders;
+    vector<RouteAdvert> batches;
+    vector<int> batchBegin, batchEnd;
+    int infinity = UNREACHABLE;  // routes costing this much or more count as unreachable
+};
+
+// How much work the exchange took
+struct DVRStats {
+    int rounds = 0;
+    long long batches = 0;  // batches received, one per (sender, listening neighbor) per round
+    long long entries = 0;  // routes in those batches
+};
+
+// The best route to one destination found so far while a node merges its batches
+struct RouteCandidate {
+    int token;
+    int cost;
+    int nextHop;
+    bool recompute;  // the route through the current next hop got worse
+};
+
+// Everything one DVR thread reuses from node to node. A destination's entry in best belongs to the
+// node being processed only while its token is that node's, so nothing needs clearing between nodes.
+// The batches the thread's nodes send are collected in out, node senders[s] starting at outStart[s].
+struct alignas(64) DVRWorker {
+    vector<RouteCandidate> best;
+    vector<int> changed;
+    vector<int> listeners;
+    vector<int> senders;
+    vector<int> outStart;
+    vector<RouteAdvert> out;
+    int token = 0;
+    long long batches = 0;
+    long long entries = 0;
+};
+
+// This function sets up a network in which every node knows only itself and its direct links
+// and is about to send all of that to its neighbors
+void initDVR(DVRNetwork& net, const Graph& graph) {
+    int n = graph.n;
+    net.graph = graph;
+    net.reverse = reverseGraph(graph);
+    net.n = n;
+    net.dist.assign((size_t)n * n, UNREACHABLE);
+    net.nextHop.assign((size_t)n * n, -1);
+    net.senders.clear();
+    net.batches.clear();
+    net.batchBegin.assign(n, 0);
+    net.batchEnd.assign(n, 0);
+
+    for (int i = 0; i < n; ++i) {
+        int* dist = &net.dist[(size_t)i * n];
+        int* nextHop = &net.nextHop[(size_t)i * n];
+        net.batchBegin[i] = net.batches.size();
+        dist[i] = 0;  // Self
+        net.batches.push_back({i, 0, -1});
+        for (int e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e) {
+            int k = graph.targets[e];
+            if (graph.costs[e] >= net.infinity) continue;  // Link down
+            dist[k] = graph.costs[e];
+            nextHop[k] = k;  // Direct link
+            net.batches.push_back({k, graph.costs[e], k});
+        }
+        net.batchEnd[i] = net.batches.size();
+        net.senders.push_back(i);
+    }
+}
+
+// This function returns what a route costs node i over a link of linkCost to a neighbor that
+// advertises cost, through its own next hop nextHop
+// Poisoned reverse: a neighbor whose route leads back through i tells i it cannot reach the
+// destination, so two nodes never route through each other. A route costing infinity or more is
+// unreachable, which ends a count to infinity around longer loops.
+int routeCost(const DVRNetwork& net, int i, int linkCost, int cost, int nextHop) {
+    if (nextHop == i || cost == UNREACHABLE || linkCost == UNREACHABLE) return UNREACHABLE;
+    long long total = (long long)linkCost + cost;
+    return total >= net.infinity ? UNREACHABLE : total;
+}
+
+// This function finds node i's best route to j from what all of its neighbors advertise
+// Every change is sent as soon as it is made, so a neighbor's table is what it last advertised.
+pair<int, int> bestDVRRoute(const DVRNetwork& net, int i, int j) {
+    if (i == j) return {0, -1};
+    const Graph& graph = net.graph;
+    pair<int, int> best = {UNREACHABLE, -1};
+    for (int e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e) {
+        int k = graph.targets[e];
+        size_t entry = (size_t)k * net.n + j;
+        int cost = routeCost(net, i, graph.costs[e], net.dist[entry], net.nextHop[entry]);
+        if (cost < best.first) best = {cost, k};
+    }
+    return best;
+}
+
+// This function merges the batches node i received in the last round into its table
+// Improvements are taken if strictly better, neighbors in index order, so a route is replaced by an
+// equally cheap one only if it is not known yet. If the route through i's current next hop got
+// worse, every neighbor's offer is looked at again. The new routes go into i's own batch for the
+// next round, but the table itself is only changed once every node is done, so that the round reads
+// the tables as they were when the batches were sent.
+void processDVRNode(const DVRNetwork& net, DVRWorker& worker, int i) {
+    int n = net.n;
+    const Graph& graph = net.graph;
+    const int* dist = &net.dist[(size_t)i * n];
+    const int* nextHop = &net.nextHop[(size_t)i * n];
+    if (++worker.token == numeric_limits<int>::max()) {
+        for (RouteCandidate& candidate : worker.best) candidate.token = 0;
+        worker.token = 1;
+    }
+    worker.changed.clear();
+
+    // This loop checks the batches from all neighbors of node i
+    for (int e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e) {
+        int k = graph.targets[e];
+        for (int b = net.batchBegin[k]; b < net.batchEnd[k]; ++b) {
+            const RouteAdvert& advert = net.batches[b];
+            int j = advert.dest;
+            if (j == i) continue;
+            int cost = routeCost(net, i, graph.costs[e], advert.cost, advert.nextHop);
+            RouteCandidate& best = worker.best[j];
+            if (best.token != worker.token) {
+                best = {worker.token, dist[j], nextHop[j], false};
+                worker.changed.push_back(j);
+            }
+            if (k == nextHop[j] && cost > dist[j]) {
+                best.recompute = true;
+            } else if (cost < best.cost) {
+                best.cost = cost;
+                best.nextHop = k;
+            }
+        }
+    }
+
+    bool sending = false;
+    for (int j : worker.changed) {
+        RouteCandidate& best = worker.best[j];
+        if (best.recompute) tie(best.cost, best.nextHop) = bestDVRRoute(net, i, j);
+        if (best.cost == dist[j] && best.nextHop == nextHop[j]) continue;
+        if (!sending) {
+            worker.senders.push_back(i);
+            worker.outStart.push_back(worker.out.size());
+            sending = true;
+        }
+        worker.out.push_back({j, best.cost, best.nextHop});
+    }
+}
+
+// This function runs the exchange until no node has anything new to tell its neighbors
+// Each round, the nodes that heard from a sender merge its batch, and those whose routes changed
+// become the senders of the next round. The work is proportional to the routes that change, not to
+// n^3 per round as in the matrix-wide Bellman-Ford, and the nodes of a round are split over threads.
+// Each node reads only the previous round's batches and writes only its own row, so the result does
+// not depend on the number of threads.
+DVRStats runDVR(DVRNetwork& net, int threads) {
+    int n = net.n;
+    threads = max(1, threads);
+    vector<DVRWorker> workers(threads);
+    for (DVRWorker& worker : workers) worker.best.assign(n, {0, 0, -1, false});
+    // Threads only pay off when a round has enough nodes in it
+    auto threadsFor = [&](size_t work) { return work >= 64 ? threads : 1; };
+    vector<atomic<int>> heard(n);
+    for (atomic<int>& round : heard) round = -1;
+    vector<int> listeners;
+
+    DVRStats stats;
+    while (!net.senders.empty()) {
+        // This finds every node with a link to a sender, each once
+        int round = stats.rounds++;
+        parallelFor(threadsFor(net.senders.size()), 0, net.senders.size(), [&](int w, int s) {
+            DVRWorker& worker = workers[w];
+            int k = net.senders[s];
+            const Graph& reverse = net.reverse;
+            int listening = reverse.offsets[k + 1] - reverse.offsets[k];
+            worker.batches += listening;
+            worker.entries += (long long)listening * (net.batchEnd[k] - net.batchBegin[k]);
+            for (int e = reverse.offsets[k]; e < reverse.offsets[k + 1]; ++e) {
+                int i = reverse.targets[e];
+                if (heard[i].exchange(round) != round) worker.listeners.push_back(i);
+            }
+        });
+        listeners.clear();
+        for (DVRWorker& worker : workers) {
+            listeners.insert(listeners.end(), worker.listeners.begin(), worker.listeners.end());
+            worker.listeners.clear();
+        }
+
+        parallelFor(threadsFor(listeners.size()), 0, listeners.size(), [&](int w, int l) {
+            processDVRNode(net, workers[w], listeners[l]);
+        });
+
+        // The round is over: the batches just read are dropped, the new ones take their place
+        for (int k : net.senders) net.batchBegin[k] = net.batchEnd[k] = 0;
+        net.senders.clear();
+        net.batches.clear();
+        for (DVRWorker& worker : workers) {
+            int base = net.batches.size();
+            for (size_t s = 0; s < worker.senders.size(); ++s) {
+                int k = worker.senders[s];
+                net.batchBegin[k] = base + worker.outStart[s];
+                net.batchEnd[k] = base + (s + 1 < worker.senders.size() ? worker.outStart[s + 1] : worker.out.size());
+                net.senders.push_back(k);
+            }
+            net.batches.insert(net.batches.end(), worker.out.begin(), worker.out.end());
+            worker.senders.clear();
+            worker.outStart.clear();
+            worker.out.clear();
+        }
+
+        // and go into the senders' tables
+        parallelFor(threadsFor(net.senders.size()), 0, net.senders.size(), [&](int, int s) {
+            int i = net.senders[s];
+            for (int b = net.batchBegin[i]; b < net.batchEnd[i]; ++b) {
+                const RouteAdvert& advert = net.batches[b];
+                net.dist[(size_t)i * n + advert.dest] = advert.cost;
+                net.nextHop[(size_t)i * n + advert.dest] = advert.nextHop;
+            }
+        });
+    }
+
+    for (const DVRWorker& worker : workers) {
+        stats.batches += worker.batches;
+        stats.entries += worker.entries;
+    }
+    return stats;
+}
+
+// This function makes node i look at all of its routes again and send the ones that changed
+// (a triggered update), as it does when one of its own links changes. It must be called between
+// rounds, and only once per node before runDVR.
+void triggerDVRUpdate(DVRNetwork& net, int i) {
+    int n = net.n;
+    net.batchBegin[i] = net.batches.size();
+    for (int j = 0; j < n; ++j) {
+        pair<int, int> best = bestDVRRoute(net, i, j);
+        size_t entry = (size_t)i * n + j;
+        if (best.first == net.dist[entry] && best.second == net.nextHop[entry]) continue;
+        net.dist[entry] = best.first;
+        net.nextHop[entry] = best.second;
+        net.batches.push_back({j, best.first, best.second});
+    }
+    net.batchEnd[i] = net.batches.size();
+    if (net.batchEnd[i] > net.batchBegin[i]) net.senders.push_back(i);
+}
+
+// This function changes the cost of the link between u and v, in both directions, in a converged
+// network and runs the exchange until it has converged again (UNREACHABLE takes the link down)
+// The link must be in the graph, if only as a link that is down.
+DVRStats changeDVRLink(DVRNetwork& net, int u, int v, int cost, int threads) {
+    int forward = findLink(net.graph, u, v), backward = findLink(net.graph, v, u);
+    if (forward < 0 || backward < 0) return DVRStats();
+    net.graph.costs[forward] = net.graph.costs[backward] = cost;
+    net.reverse.costs[findLink(net.reverse, v, u)] = net.reverse.costs[findLink(net.reverse, u, v)] = cost;
+    triggerDVRUpdate(net, u);
+    triggerDVRUpdate(net, v);
+    return runDVR(net, threads);
+}
+
 // This function prints the routing table for a given node
 // It shows the destination, cost to reach it, and the next hop node
-void printDVRTable(int node, const vector<vector<int>>& table, const vector<vector<int>>& nextHop) {
+void printDVRTable(int node, const DVRNetwork& net) {
     cout << "Node " << node << " Routing Table:\n";
     cout << "Dest\tCost\tNext Hop\n";
-    for (int i = 0; i < table.size(); ++i) {
-        cout << i << "\t" << table[node][i] << "\t";
-        if (nextHop[node][i] == -1) cout << "-";
-        else cout << nextHop[node][i];
-        cout << endl;
+    for (int i = 0; i < net.n; ++i) {
+        int cost = net.dist[(size_t)node * net.n + i];
+        int hop = net.nextHop[(size_t)node * net.n + i];
+        cout << i << "\t" << (cost == UNREACHABLE ? INF : cost) << "\t";
+        if (hop == -1) cout << "-";
+        else cout << hop;
+        cout << "\n";
     }
-    cout << endl;
+    cout << "\n";
 }
 
 // This function simulates the Distance Vector Routing (DVR) algorithm
-// It initializes the distance table and next hop table, then applies the Bellman-Ford algorithm
-void simulateDVR(const vector<vector<int>>& graph) {
-    int n = graph.size();
-    vector<vector<int>> dist = graph;
-    vector<vector<int>> nextHop(n, vector<int>(n, -1));
+// Every node starts out knowing its direct links, and the nodes exchange distance vectors until the
+// tables stop changing (see runDVR). quiet prints a summary instead of n tables.
+void simulateDVR(const Graph& graph, bool quiet, int threads) {
+    int n = graph.n;
+    if (n > MAX_TABLE_NODES) {
+        cout << "DVR skipped: " << n << " nodes would need " << n << " x " << n << " tables (limit "
+             << MAX_TABLE_NODES << " nodes)\n";
+        return;
+    }
+    threads = max(1, min(threads, n));
+    auto start = chrono::steady_clock::now();
+    DVRNetwork net;
+    initDVR(net, graph);
+    DVRStats stats = runDVR(net, threads);
 
-    // This initializes the next hop matrix
-    for (int i = 0; i < n; ++i) {
-        for (int j = 0; j < n; ++j) {
-            if (i == j) {
-                nextHop[i][j] = -1;  // Self
-            } else if (graph[i][j] != INF) {
-                nextHop[i][j] = j;  // Direct link
+    if (quiet) {
+        long long reachable = 0, totalCost = 0;
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                int cost = net.dist[(size_t)i * n + j];
+                if (i == j || cost == UNREACHABLE) continue;
+                ++reachable;
+                totalCost += cost;
             }
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "DVR: " << n << " nodes, " << reachable << " reachable pairs, total cost " << totalCost << ", "
+             << fixed << setprecision(3) << seconds << " s on " << threads << (threads == 1 ? " thread\n" : " threads\n");
+        cout << "DVR converged after " << stats.rounds << " rounds: " << stats.batches << " batches, "
+             << stats.entries << " route entries\n";
+        return;
     }
+    cout << "--- DVR Final Tables ---\n";
+    for (int i = 0; i < n; ++i) printDVRTable(i, net);
+    cout << flush;
+}
 
-    // This applies the Bellman-Ford algorithm to find the shortest paths
-    // and update the next hop table
-    bool updated;
-    do {
-        updated = false;
-        // This loop checks all nodes
-        for (int i = 0; i < n; ++i) {
-            // This loop checks all destinations
-            for (int j = 0; j < n; ++j) {
-                // This skips if the same node
-                if (i == j) continue;
-                
-                // This loop checks through all neighbors of node i
-                for (int k = 0; k < n; ++k) {
-                    // This skips if no direct link to neighbor k or if k is the same as i or j
-                    // or if the distance to k is infinite
-                    if (i == k || j == k || graph[i][k] == INF) continue;
-                    
-                    // This checks if the path through k is better than the current path
-                    if (dist[i][j] > graph[i][k] + dist[k][j]) {
-                        dist[i][j] = graph[i][k] + dist[k][j];
-                        nextHop[i][j] = k;  // This updates the next hop to the neighbor
-                        // This marks that an update has occurred
-                        updated = true;
-                    }
-                }
+// The shortest-path tree from one source, as computed by dijkstra()
+struct ShortestPaths {
+    vector<int> dist;      // UNREACHABLE if there is no path
+    vector<int> prev;      // predecessor on the path; -1 for the source and unreachable nodes
+    vector<int> firstHop;  // the source's neighbor the path leaves through; -1 if none
+};
+
+// This function settles the nodes in heap, and every node they lead to a shorter path to, in order of
+// distance, and returns how many it settled
+// heap holds (distance, node) pairs ordered with greater<>; stale entries are skipped when popped
+// instead of being updated.
+int settle(const Graph& graph, int src, ShortestPaths& paths, vector<pair<int, int>>& heap) {
+    greater<pair<int, int>> later;
+    int settled = 0;
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), later);
+        pair<int, int> top = heap.back();
+        heap.pop_back();
+        int u = top.second;
+        if (top.first != paths.dist[u]) continue;
+        ++settled;
+
+        // u is settled, so its predecessor is final and so is the hop its path starts with
+        int p = paths.prev[u];
+        if (p != -1) paths.firstHop[u] = p == src ? u : paths.firstHop[p];
+
+        // This loop checks all neighbors of u
+        for (int e = graph.offsets[u]; e < graph.offsets[u + 1]; ++e) {
+            int v = graph.targets[e];
+            long long candidate = (long long)top.first + graph.costs[e];
+            if (candidate < paths.dist[v]) {
+                paths.dist[v] = candidate;
+                paths.prev[v] = u;
+                heap.push_back({(int)candidate, v});
+                push_heap(heap.begin(), heap.end(), later);
             }
         }
-    } while (updated);
+    }
+    return settled;
+}
 
-    cout << "--- DVR Final Tables ---\n";
-    for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+// This function runs Dijkstra's algorithm from src with a binary heap, in O((n + m) log n)
+// Nodes at equal distance are settled in index order and a distance only changes on a strict
+// improvement, so the result is the same tree the O(n^2) scan over the adjacency matrix found.
+// heap is scratch space, kept by the caller so it is not reallocated for every source.
+void dijkstra(const Graph& graph, int src, ShortestPaths& paths, vector<pair<int, int>>& heap) {
+    int n = graph.n;
+    paths.dist.assign(n, UNREACHABLE);
+    paths.prev.assign(n, -1);
+    paths.firstHop.assign(n, -1);
+    heap.clear();
+    paths.dist[src] = 0;
+    heap.push_back({0, src});
+    settle(graph, src, paths, heap);
 }
 
 // This function prints the routing table for a given node in the Link State Routing (LSR) algorithm
 // It shows the destination, cost to reach it, and the next hop node
-void printLSRTable(int src, const vector<int>& dist, const vector<int>& prev) {
-    cout << "Node " << src << " Routing Table:\n";
-    cout << "Dest\tCost\tNext Hop\n";
-    for (int i = 0; i < dist.size(); ++i) {
+void printLSRTable(ostream& out, int src, const ShortestPaths& paths) {
+    out << "Node " << src << " Routing Table:\n";
+    out << "Dest\tCost\tNext Hop\n";
+    for (int i = 0, n = paths.dist.size(); i < n; ++i) {
         if (i == src) continue;
-        cout << i << "\t" << dist[i] << "\t";
-        int hop = i;
-        while (prev[hop] != src && prev[hop] != -1)
-            hop = prev[hop];
-        cout << (prev[hop] == -1 ? -1 : hop) << endl;
+        out << i << "\t" << (paths.dist[i] == UNREACHABLE ? INF : paths.dist[i]) << "\t";
+        out << paths.firstHop[i] << "\n";
     }
-    cout << endl;
+    out << "\n";
 }
 
+// Everything one LSR thread reuses from source to source, so the per-source Dijkstra runs allocate
+// nothing. Aligned to a cache line so the counters of neighboring workers do not share one.
+struct alignas(64) LSRWorker {
+    ShortestPaths paths;
+    vector<pair<int, int>> heap;
+    long long reachable = 0;
+    long long totalCost = 0;
+};
+
 // This function simulates the Link State Routing (LSR) algorithm
-// It initializes the distance and previous node tables, then applies Dijkstra's algorithm
-void simulateLSR(const vector<vector<int>>& graph) {
-    int n = graph.size();
-    for (int src = 0; src < n; ++src) {
-        vector<int> dist(n, INF);
-        vector<int> prev(n, -1);
-        vector<bool> visited(n, false);
-        dist[src] = 0;
-        
-        // This applies Dijkstra's algorithm to find the shortest paths
-        for (int count = 0; count < n; ++count) {
-            // This finds the minimum distance vertex from the set of vertices not yet visited
-            int u = -1;
-            int minDistance = INF;
-            for (int v = 0; v < n; ++v) {
-                if (!visited[v] && dist[v] < minDistance) {
-                    minDistance = dist[v];
-                    u = v;
-                }
+// It runs Dijkstra's algorithm from every node, the sources spread over threads. Tables are
+// printed in source order: sources are computed a block at a time, each into its own buffer, and
+// the block is printed once all of it is done. quiet prints a summary instead of n tables.
+void simulateLSR(const Graph& graph, bool quiet, int threads) {
+    int n = graph.n;
+    threads = max(1, min(threads, n));
+    vector<LSRWorker> workers(threads);
+    auto start = chrono::steady_clock::now();
+
+    if (quiet) {
+        parallelFor(threads, 0, n, [&](int w, int src) {
+            LSRWorker& worker = workers[w];
+            dijkstra(graph, src, worker.paths, worker.heap);
+            for (int i = 0; i < n; ++i) {
+                if (i == src || worker.paths.dist[i] == UNREACHABLE) continue;
+                ++worker.reachable;
+                worker.totalCost += worker.paths.dist[i];
             }
-            
-            // This breaks if all vertices are visited
-            // or if the minimum distance is infinite (no path)
-            if (u == -1) break;
-            
-            // This marks the vertex as visited
-            // and updates the distance to its neighbors
-            visited[u] = true;
-            
-            // This loop checks all neighbors of u
-            for (int v = 0; v < n; ++v) {
-                if (!visited[v] && graph[u][v] != INF && 
-                    dist[u] + graph[u][v] < dist[v]) {
-                    dist[v] = dist[u] + graph[u][v];
-                    prev[v] = u;
-                }
+        });
+
+        long long reachable = 0, totalCost = 0;
+        for (const LSRWorker& worker : workers) {
+            reachable += worker.reachable;
+            totalCost += worker.totalCost;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "LSR: " << n << " sources, " << reachable << " reachable pairs, total cost " << totalCost
+             << ", " << fixed << setprecision(3) << seconds << " s on " << threads << (threads == 1 ? " thread\n" : " threads\n");
+        return;
+    }
+
+    // About 64 MB of formatted tables per block, but at least a few sources per thread
+    const long long bytesPerTable = 16LL * n + 64;
+    const int block = max<long long>(threads * 4, min<long long>(n, (64LL << 20) / bytesPerTable));
+    vector<string> tables(min(block, n));
+    for (int first = 0; first < n; first += block) {
+        int last = min(n, first + block);
+        parallelFor(threads, first, last, [&](int w, int src) {
+            LSRWorker& worker = workers[w];
+            dijkstra(graph, src, worker.paths, worker.heap);
+            ostringstream out;
+            printLSRTable(out, src, worker.paths);
+            tables[src - first] = out.str();
+        });
+        for (int src = first; src < last; ++src) cout << tables[src - first];
+    }
+    cout << flush;
+}
+
+// Everything one thread reuses while repairing shortest-path trees after a link change. mark[x]
+// equals token while x is in the subtree being repaired, so it is never cleared between trees.
+struct alignas(64) LSRRepairWorker {
+    vector<int> mark;
+    int token = 0;
+    vector<int> subtree;
+    vector<pair<int, int>> heap;
+    long long trees = 0;     // trees that changed
+    long long settled = 0;   // nodes settled again in them
+};
+
+// This function repairs src's shortest-path tree after link u -> v changed from oldCost to the cost
+// it now has in graph, and returns how many nodes it settled again
+// A cheaper link can only shorten paths through it: v gets the new distance and Dijkstra's algorithm
+// runs on from v for as long as distances keep dropping. A dearer link only matters if it is in the
+// tree, and then only to the subtree under v. Those nodes are cut off, each is offered its best way in
+// from the rest of the tree (reverse lists the links into a node), and Dijkstra's algorithm settles
+// them again. Everything else keeps its distance and next hop.
+int repairShortestPaths(const Graph& graph, const Graph& reverse, int src, int u, int v, int oldCost,
+                        ShortestPaths& paths, LSRRepairWorker& worker) {
+    int newCost = graph.costs[findLink(graph, u, v)];
+    vector<pair<int, int>>& heap = worker.heap;
+    heap.clear();
+
+    if (newCost < oldCost) {
+        if (paths.dist[u] == UNREACHABLE) return 0;
+        long long candidate = (long long)paths.dist[u] + newCost;
+        if (candidate >= paths.dist[v]) return 0;
+        paths.dist[v] = candidate;
+        paths.prev[v] = u;
+        heap.push_back({(int)candidate, v});
+        return settle(graph, src, paths, heap);
+    }
+
+    if (paths.prev[v] != u) return 0;
+    if (++worker.token == numeric_limits<int>::max()) {
+        fill(worker.mark.begin(), worker.mark.end(), 0);
+        worker.token = 1;
+    }
+    // This collects the subtree under v: the nodes whose path to src runs through u -> v
+    vector<int>& subtree = worker.subtree;
+    subtree.assign(1, v);
+    worker.mark[v] = worker.token;
+    for (size_t s = 0; s < subtree.size(); ++s) {
+        int x = subtree[s];
+        for (int e = graph.offsets[x]; e < graph.offsets[x + 1]; ++e) {
+            int y = graph.targets[e];
+            if (paths.prev[y] == x && worker.mark[y] != worker.token) {
+                worker.mark[y] = worker.token;
+                subtree.push_back(y);
+            }
+        }
+    }
+    for (int x : subtree) {
+        paths.dist[x] = UNREACHABLE;
+        paths.prev[x] = -1;
+        paths.firstHop[x] = -1;
+    }
+
+    // This gives each node of the subtree its best link in from outside it
+    for (int x : subtree) {
+        for (int e = reverse.offsets[x]; e < reverse.offsets[x + 1]; ++e) {
+            int w = reverse.targets[e];
+            if (worker.mark[w] == worker.token || paths.dist[w] == UNREACHABLE) continue;
+            long long candidate = (long long)paths.dist[w] + reverse.costs[e];
+            if (candidate < paths.dist[x]) {
+                paths.dist[x] = candidate;
+                paths.prev[x] = w;
             }
         }
-        
-        printLSRTable(src, dist, prev);
+        if (paths.dist[x] != UNREACHABLE) heap.push_back({paths.dist[x], x});
     }
+    make_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
+    settle(graph, src, paths, heap);
+    return subtree.size();
+}
+
+// Every node's shortest-path tree, kept so that link changes can be applied to them
+struct LSRNetwork {
+    Graph graph;
+    Graph reverse;
+    vector<ShortestPaths> trees;
+    vector<LSRRepairWorker> workers;
+};
+
+// How much work a link change took: the trees it changed and the nodes settled again in them
+struct LSRRepairStats {
+    long long trees = 0;
+    long long settled = 0;
+};
+
+// This function computes the shortest-path tree of every node, the sources spread over threads
+void initLSR(LSRNetwork& net, const Graph& graph, int threads) {
+    int n = graph.n;
+    threads = max(1, min(threads, n));
+    net.graph = graph;
+    net.reverse = reverseGraph(graph);
+    net.trees.assign(n, ShortestPaths());
+    net.workers.assign(threads, LSRRepairWorker());
+    for (LSRRepairWorker& worker : net.workers) worker.mark.assign(n, 0);
+    parallelFor(threads, 0, n, [&](int w, int src) {
+        dijkstra(net.graph, src, net.trees[src], net.workers[w].heap);
+    });
+}
+
+// This function changes the cost of the link between u and v, in both directions, and repairs every
+// tree (UNREACHABLE takes the link down)
+// The link must be in the graph, if only as a link that is down.
+LSRRepairStats changeLSRLink(LSRNetwork& net, int u, int v, int cost) {
+    LSRRepairStats stats;
+    int threads = net.workers.size();
+    for (int direction = 0; direction < 2; ++direction) {
+        int from = direction == 0 ? u : v, to = direction == 0 ? v : u;
+        int forward = findLink(net.graph, from, to);
+        if (forward < 0) continue;
+        int oldCost = net.graph.costs[forward];
+        if (oldCost == cost) continue;
+        net.graph.costs[forward] = cost;
+        net.reverse.costs[findLink(net.reverse, to, from)] = cost;
+        parallelFor(threads, 0, net.graph.n, [&](int w, int src) {
+            LSRRepairWorker& worker = net.workers[w];
+            int settled = repairShortestPaths(net.graph, net.reverse, src, from, to, oldCost, net.trees[src], worker);
+            if (settled == 0) return;
+            ++worker.trees;
+            worker.settled += settled;
+        });
+    }
+    for (LSRRepairWorker& worker : net.workers) {
+        stats.trees += worker.trees;
+        stats.settled += worker.settled;
+        worker.trees = worker.settled = 0;
+    }
+    return stats;
 }
 
 // This function reads the graph from a file
-// The first line contains the number of nodes, followed by the adjacency matrix
-vector<vector<int>> readGraphFromFile(const string& filename) {
+// Two formats are accepted, told apart by the first line:
+//   "<N>" followed by the N x N adjacency matrix (INF for no link)
+//   "<N> <M>" followed by M lines "<u> <v> <cost>", one per (bidirectional) link
+vector<Edge> readGraphFromFile(const string& filename, int& n) {
     ifstream file(filename);
     if (!file.is_open()) {
         cerr << "Error: Could not open file " << filename << endl;
         exit(1);
     }
-    
-    int n;
-    file >> n;
-    vector<vector<int>> graph(n, vector<int>(n));
 
-    for (int i = 0; i < n; ++i)
-        for (int j = 0; j < n; ++j)
-            file >> graph[i][j];
+    string header;
+    getline(file, header);
+    istringstream fields(header);
+    long long links = -1;
+    if (!(fields >> n) || n < 0) {
+        cerr << "Error: " << filename << " does not start with the number of nodes" << endl;
+        exit(1);
+    }
+    fields >> links;
+
+    vector<Edge> edges;
+    if (links < 0) {
+        // Adjacency matrix, read row by row without keeping it
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                int cost;
+                file >> cost;
+                if (i != j && cost != INF) edges.push_back({i, j, cost});
+            }
+        }
+    } else {
+        edges.reserve(2 * links);
+        for (long long l = 0; l < links; ++l) {
+            int u, v, cost;
+            if (!(file >> u >> v >> cost) || u < 0 || u >= n || v < 0 || v >= n) {
+                cerr << "Error: bad link on line " << l + 2 << " of " << filename << endl;
+                exit(1);
+            }
+            edges.push_back({u, v, cost});
+            edges.push_back({v, u, cost});
+        }
+    }
 
     file.close();
-    return graph;
+    return edges;
 }
 
+// A change to the link between u and v, in both directions: its new cost, or UNREACHABLE if it goes down
+struct LinkEvent {
+    int u;
+    int v;
+    int cost;
+};
+
+// This function reads a list of link events from a file, one per line:
+//   "down <u> <v>"            the link goes down
+//   "up <u> <v> <cost>"       the link comes (back) up with the given cost
+//   "cost <u> <v> <cost>"     the link's cost changes
+// Empty lines and lines starting with # are skipped.
+vector<LinkEvent> readEvents(const string& filename, int n) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filename << endl;
+        exit(1);
+    }
+
+    vector<LinkEvent> events;
+    string line;
+    for (int number = 1; getline(file, line); ++number) {
+        istringstream fields(line);
+        string kind;
+        if (!(fields >> kind) || kind[0] == '#') continue;
+        LinkEvent event;
+        bool ok = (bool)(fields >> event.u >> event.v);
+        if (kind == "down") event.cost = UNREACHABLE;
+        else ok = ok && (kind == "up" || kind == "cost") && fields >> event.cost && event.cost >= 0;
+        if (!ok || event.u < 0 || event.u >= n || event.v < 0 || event.v >= n || event.u == event.v) {
+            cerr << "Error: bad event on line " << number << " of " << filename << endl;
+            exit(1);
+        }
+        events.push_back(event);
+    }
+
+    file.close();
+    return events;
+}
+
+// This function generates a random connected topology in the style of an ISP network
+// Every node links to a random earlier node, which makes a spanning tree, and then random links are added
+// until the average node has linksPerNode of them. Costs are between 1 and 100.
+vector<Edge> randomTopology(int n, int linksPerNode, unsigned seed) {
+    mt19937 rng(seed);
+    uniform_int_distribution<int> costs(1, 100);
+    vector<Edge> edges;
+    long long target = (long long)n * linksPerNode / 2;
+    edges.reserve(2 * max<long long>(target, n));
+    auto link = [&](int u, int v) {
+        int cost = costs(rng);
+        edges.push_back({u, v, cost});
+        edges.push_back({v, u, cost});
+    };
+    for (int v = 1; v < n; ++v) link(uniform_int_distribution<int>(0, v - 1)(rng), v);
+    uniform_int_distribution<int> any(0, max(n - 1, 0));
+    for (long long l = n - 1; l < target && n > 1; ++l) {
+        int u = any(rng), v = any(rng);
+        if (u != v) link(u, v);
+    }
+    return edges;
+}
+
+// This function converges both algorithms on the topology and then applies the link events to
+// them one at a time, reporting for each how much work it took to converge again
+// DVR gets triggered updates from the two ends of the changed link (see changeDVRLink) and LSR
+// repairs only the parts of the trees the link affects (see repairShortestPaths). Links that events
+// bring up must already be in the graph, as links that are down. infinity is the cost at which a DVR
+// route counts as unreachable; 0 picks one above the cost of any loop-free path. quiet leaves out the
+// routing tables after the last event.
+void simulateEvents(const Graph& graph, const vector<LinkEvent>& events, bool useDVR, bool useLSR, bool quiet,
+                    int threads, int infinity) {
+    int n = graph.n;
+    if (n > MAX_TABLE_NODES) {
+        cout << "Link events skipped: " << n << " nodes would need " << n << " x " << n << " tables (limit "
+             << MAX_TABLE_NODES << " nodes)\n";
+        return;
+    }
+    threads = max(1, min(threads, n));
+    if (infinity <= 0) {
+        long long maxCost = 1;
+        for (int cost : graph.costs) {
+            if (cost != UNREACHABLE) maxCost = max<long long>(maxCost, cost);
+        }
+        for (const LinkEvent& event : events) {
+            if (event.cost != UNREACHABLE) maxCost = max<long long>(maxCost, event.cost);
+        }
+        infinity = min<long long>(UNREACHABLE, max(n - 1, 1) * maxCost + 1);
+    }
+    auto seconds = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    cout << fixed << setprecision(3);
+
+    DVRNetwork dvr;
+    LSRNetwork lsr;
+    if (useDVR) {
+        auto start = chrono::steady_clock::now();
+        dvr.infinity = infinity;
+        initDVR(dvr, graph);
+        DVRStats stats = runDVR(dvr, threads);
+        cout << "DVR converged after " << stats.rounds << " rounds: " << stats.batches << " batches, " << stats.entries
+             << " route entries, " << seconds(start) << " s (infinity " << infinity << ")\n";
+    }
+    if (useLSR) {
+        auto start = chrono::steady_clock::now();
+        initLSR(lsr, graph, threads);
+        cout << "LSR computed " << n << " shortest-path trees in " << seconds(start) << " s\n";
+    }
+
+    for (size_t e = 0; e < events.size(); ++e) {
+        const LinkEvent& event = events[e];
+        cout << "\nEvent " << e + 1 << ": link " << event.u << " - " << event.v;
+        if (event.cost == UNREACHABLE) cout << " down\n";
+        else cout << " cost " << event.cost << "\n";
+        if (useDVR) {
+            auto start = chrono::steady_clock::now();
+            DVRStats stats = changeDVRLink(dvr, event.u, event.v, event.cost, threads);
+            cout << "  DVR: " << stats.rounds << " rounds, " << stats.batches << " batches, " << stats.entries
+                 << " route entries, " << seconds(start) << " s\n";
+        }
+        if (useLSR) {
+            auto start = chrono::steady_clock::now();
+            LSRRepairStats stats = changeLSRLink(lsr, event.u, event.v, event.cost);
+            cout << "  LSR: " << stats.trees << " tree repairs, " << stats.settled << " nodes settled again, "
+                 << seconds(start) << " s\n";
+        }
+    }
+
+    if (quiet) return;
+    if (useDVR) {
+        cout << "\n--- DVR Tables After Events ---\n";
+        for (int i = 0; i < n; ++i) printDVRTable(i, dvr);
+    }
+    if (useLSR) {
+        cout << "\n--- LSR Tables After Events ---\n";
+        for (int src = 0; src < n; ++src) printLSRTable(cout, src, lsr.trees[src]);
+    }
+    cout << flush;
+}
+
+void usage(const char* program) {
+    cerr << "Usage: " << program << " <input_file> [--algo both|dvr|lsr] [--quiet] [--threads N]\n"
+         << "       " << program << " --random <nodes> <links_per_node> [seed] [--algo ...] [--quiet]\n"
+         << "       either of the above with --events <event_file> [--infinity N]\n";
+    exit(1);
+}
 
 // This is the main function that reads the graph from a file and simulates both routing algorithms
 // It takes the filename as a command line argument
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " <input_file>\n";
-        return 1;
+    if (argc < 2) usage(argv[0]);
+
+    int n = 0;
+    vector<Edge> edges;
+    int arg = 1;
+    if (string(argv[1]) == "--random") {
+        if (argc < 4) usage(argv[0]);
+        n = atoi(argv[2]);
+        int linksPerNode = atoi(argv[3]);
+        arg = 4;
+        unsigned seed = 1;
+        if (arg < argc && argv[arg][0] != '-') seed = strtoul(argv[arg++], nullptr, 10);
+        edges = randomTopology(n, linksPerNode, seed);
+    } else {
+        edges = readGraphFromFile(argv[1], n);
+        arg = 2;
     }
 
-    string filename = argv[1];
-    vector<vector<int>> graph = readGraphFromFile(filename);
+    // Options: which simulations to run, and whether to print summaries instead of every table
+    bool runDVR = true, runLSR = true, quiet = false;
+    int threads = max(1u, thread::hardware_concurrency());
+    string eventFile;
+    int infinity = 0;
+    for (; arg < argc; ++arg) {
+        string option = argv[arg];
+        if (option == "--quiet") {
+            quiet = true;
+        } else if (option == "--threads" && arg + 1 < argc) {
+            threads = atoi(argv[++arg]);
+            if (threads < 1) usage(argv[0]);
+        } else if (option == "--algo" && arg + 1 < argc) {
+            string algo = argv[++arg];
+            if (algo != "both" && algo != "dvr" && algo != "lsr") usage(argv[0]);
+            runDVR = algo != "lsr";
+            runLSR = algo != "dvr";
+        } else if (option == "--events" && arg + 1 < argc) {
+            eventFile = argv[++arg];
+        } else if (option == "--infinity" && arg + 1 < argc) {
+            infinity = atoi(argv[++arg]);
+            if (infinity < 1) usage(argv[0]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // Links that events bring up start out down, so that the graph's layout never has to change
+    vector<LinkEvent> events;
+    if (!eventFile.empty()) events = readEvents(eventFile, n);
+    for (const LinkEvent& event : events) {
+        if (event.cost == UNREACHABLE) continue;
+        edges.push_back({event.u, event.v, UNREACHABLE});
+        edges.push_back({event.v, event.u, UNREACHABLE});
+    }
+
+    Graph graph = buildGraph(n, edges);
+    vector<Edge>().swap(edges);
+    if (quiet) {
+        int up = count_if(graph.costs.begin(), graph.costs.end(), [](int cost) { return cost != UNREACHABLE; });
+        cout << "Topology: " << graph.n << " nodes, " << up << " directed links\n";
+    }
 
-    cout << "\n--- Distance Vector Routing Simulation ---\n";
-    simulateDVR(graph);
+    if (!eventFile.empty()) {
+        cout << "\n--- Link Event Simulation ---\n";
+        simulateEvents(graph, events, runDVR, runLSR, quiet, threads, infinity);
+        return 0;
+    }
 
-    cout << "\n--- Link State Routing Simulation ---\n";
-    simulateLSR(graph);
+    if (runDVR) {
+        cout << "\n--- Distance Vector Routing Simulation ---\n";
+        simulateDVR(graph, quiet, threads);
+    }
+
+    if (runLSR) {
+        cout << "\n--- Link State Routing Simulation ---\n";
+        simulateLSR(graph, quiet, threads);
+    }
 
     return 0;
 }
\ No newline at end of file